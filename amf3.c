@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "amf3.h"
 
 #ifdef HAVE_FLEX_COMMON_OBJECTS
@@ -16,55 +18,76 @@ static const struct amf3_plugin_parser g_plugin_parsers[] = {
 	flex_parse_acknowledgemessageext,
 	flex_free_acknowledgemessageext,
 	flex_dump_acknowledgemessageext,
-	flex_serialize_acknowledgemessageext
+	flex_serialize_acknowledgemessageext,
+	flex_foreach_acknowledgemessageext,
+	flex_visit_acknowledgemessageext,
+	flex_get_acknowledgemessageext
     },
     {
 	"flex.messaging.messages.AcknowledgeMessageExt",
 	flex_parse_acknowledgemessageext,
 	flex_free_acknowledgemessageext,
 	flex_dump_acknowledgemessageext,
-	flex_serialize_acknowledgemessageext
+	flex_serialize_acknowledgemessageext,
+	flex_foreach_acknowledgemessageext,
+	flex_visit_acknowledgemessageext,
+	flex_get_acknowledgemessageext
     },
     {
 	"DSA",
 	flex_parse_asyncmessageext,
 	flex_free_asyncmessageext,
 	flex_dump_asyncmessageext,
-	flex_serialize_asyncmessageext
+	flex_serialize_asyncmessageext,
+	flex_foreach_asyncmessageext,
+	flex_visit_asyncmessageext,
+	flex_get_asyncmessageext
     },
     {
 	"flex.messaging.messages.AsyncMessageExt",
 	flex_parse_asyncmessageext,
 	flex_free_asyncmessageext,
 	flex_dump_asyncmessageext,
-	flex_serialize_asyncmessageext
+	flex_serialize_asyncmessageext,
+	flex_foreach_asyncmessageext,
+	flex_visit_asyncmessageext,
+	flex_get_asyncmessageext
     },
     {
 	"DSC",
 	flex_parse_commandmessageext,
 	flex_free_commandmessageext,
 	flex_dump_commandmessageext,
-	flex_serialize_commandmessageext
+	flex_serialize_commandmessageext,
+	flex_foreach_commandmessageext,
+	flex_visit_commandmessageext,
+	flex_get_commandmessageext
     },
     {
 	"flex.messaging.messages.CommandMessageExt",
 	flex_parse_commandmessageext,
 	flex_free_commandmessageext,
 	flex_dump_commandmessageext,
-	flex_serialize_commandmessageext
+	flex_serialize_commandmessageext,
+	flex_foreach_commandmessageext,
+	flex_visit_commandmessageext,
+	flex_get_commandmessageext
     },
     {
 	"flex.messaging.io.ArrayCollection",
 	flex_parse_arraycollection,
 	flex_free_arraycollection,
 	flex_dump_arraycollection,
-	flex_serialize_arraycollection
+	flex_serialize_arraycollection,
+	flex_foreach_arraycollection,
+	flex_visit_arraycollection,
+	flex_get_arraycollection
     },
 #endif
-    {NULL, NULL, NULL, NULL, NULL}
+    {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
 };
 
-#define ALLOC(type, nobjs) ((type *)malloc(sizeof(type) * nobjs))
+#define ALLOC(type, nobjs) ((type *)malloc(sizeof(type) * (nobjs)))
 #define CALLOC(nobjs, type) ((type *)calloc(nobjs, sizeof(type)))
 
 #define LOG_ERROR (1)
@@ -73,6 +96,9 @@ static const struct amf3_plugin_parser g_plugin_parsers[] = {
 #   define DEBUG_LEVEL LOG_ERROR
 #endif
 
+/* for printing strings that may not be NUL-terminated with "%.*s" */
+#define STRARG(v) amf3_string_len(v), amf3_string_cstr(v)
+
 static void LOG(int level, const char *fmt, ...) {
     if (level <= DEBUG_LEVEL) {
 	va_list ap;
@@ -82,39 +108,351 @@ static void LOG(int level, const char *fmt, ...) {
     }
 }
 
-static struct amf3_value *amf3__new_value(char type) {
-    struct amf3_value *v = ALLOC(struct amf3_value, 1);
+#define AMF3_VALUE_NOREFCOUNT (AMF3_VALUE_ARENA | AMF3_VALUE_IMMORTAL)
+
+#ifdef AMF3_ATOMIC_REFCOUNT
+#   define amf3__refcount_atomic(v) 1
+#else
+#   define amf3__refcount_atomic(v) ((v)->flags & AMF3_VALUE_FROZEN)
+#endif
+
+/* frozen values are shared between threads and must not change. */
+#define amf3__mutable(v) (!((v)->flags & AMF3_VALUE_FROZEN))
+
+/* a lazy value decodes in place; `amf3__force' is true once it has. */
+static int amf3__materialize(AMF3Value v);
+#define amf3__force(v) \
+    (!((v)->flags & AMF3_VALUE_LAZY) || amf3__materialize(v) == 0)
+
+#define IMMORTAL(t) {0, (t), AMF3_VALUE_IMMORTAL, {0}}
+static struct amf3_value g_undefined = IMMORTAL(AMF3_UNDEFINED);
+static struct amf3_value g_null = IMMORTAL(AMF3_NULL);
+static struct amf3_value g_false = IMMORTAL(AMF3_FALSE);
+static struct amf3_value g_true = IMMORTAL(AMF3_TRUE);
+
+#define SMALLINT(n) {0, AMF3_INTEGER, AMF3_VALUE_IMMORTAL, {.integer = (n)}}
+#define SMALLINT4(n) SMALLINT(n), SMALLINT((n) + 1), \
+    SMALLINT((n) + 2), SMALLINT((n) + 3)
+#define SMALLINT16(n) SMALLINT4(n), SMALLINT4((n) + 4), \
+    SMALLINT4((n) + 8), SMALLINT4((n) + 12)
+#define SMALLINT64(n) SMALLINT16(n), SMALLINT16((n) + 16), \
+    SMALLINT16((n) + 32), SMALLINT16((n) + 48)
+#define SMALLINT128(n) SMALLINT64(n), SMALLINT64((n) + 64)
+static struct amf3_value g_smallints[] = {
+    SMALLINT128(-128), SMALLINT128(0), SMALLINT128(128), SMALLINT128(256),
+    SMALLINT128(384), SMALLINT128(512), SMALLINT128(640), SMALLINT128(768),
+    SMALLINT128(896)
+};
+typedef char amf3__smallints_size_check[
+    sizeof(g_smallints) / sizeof(g_smallints[0]) ==
+    AMF3_SMALLINT_MAX - AMF3_SMALLINT_MIN + 1 ? 1 : -1];
+
+static void *amf3__alloc(Arena arena, size_t size) {
+    return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+static struct amf3_value *amf3__new_value(Arena arena, char type) {
+    switch (type) {
+	case AMF3_UNDEFINED:	return &g_undefined;
+	case AMF3_NULL:		return &g_null;
+	case AMF3_FALSE:	return &g_false;
+	case AMF3_TRUE:		return &g_true;
+    }
+    struct amf3_value *v = amf3__alloc(arena, sizeof(struct amf3_value));
     if (v) {
 	memset(v, 0, sizeof(*v));
 	v->retain_count = 1;
 	v->type = type;
+	if (arena)
+	    v->flags |= AMF3_VALUE_ARENA;
     }
     return v;
 }
 
-static void *amf3__kv_release_cb(
-	List list, int idx, void *INLIST, void *unused) {
-    struct amf3_kv *inlist = (struct amf3_kv *)INLIST;
-    amf3_release(inlist->key);
-    amf3_release(inlist->value);
-    free(inlist);
+/* FNV-1a */
+static unsigned int amf3__hash_bytes(unsigned int h, const void *data, int len) {
+    const unsigned char *p = (const unsigned char *)data;
+    int i;
+    for (i = 0; i < len; i++) {
+	h ^= p[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+#define AMF3_HASH_SEED (2166136261u)
+
+static unsigned int amf3__hash_string(unsigned int h, AMF3Value s) {
+    if (!s)
+	return amf3__hash_bytes(h, "", 1);
+    h = amf3__hash_bytes(h, &s->v.binary.length, sizeof(int));
+    return amf3__hash_bytes(h, s->v.binary.data, s->v.binary.length);
+}
+
+static int amf3__string_equal(AMF3Value a, AMF3Value b) {
+    if (a == b)
+	return 1;
+    if (!a || !b)
+	return 0;
+    // interned strings are unique
+    if (a->flags & b->flags & AMF3_VALUE_INTERNED)
+	return 0;
+    return a->v.binary.length == b->v.binary.length &&
+	memcmp(a->v.binary.data, b->v.binary.data, a->v.binary.length) == 0;
+}
+
+static struct amf3_kvmap *amf3__kvmap_new(Arena arena) {
+    struct amf3_kvmap *m = arena
+	? arena_calloc(arena, 1, sizeof(struct amf3_kvmap))
+	: CALLOC(1, struct amf3_kvmap);
+    if (m)
+	m->arena = arena;
+    return m;
+}
+
+static void amf3__kvmap_free(struct amf3_kvmap *m) {
+    int i;
+    for (i = 0; i < m->count; i++) {
+	amf3_release(m->entries[i].key);
+	amf3_release(m->entries[i].value);
+    }
+    if (m->arena)
+	return;
+    free(m->entries);
+    free(m->slots);
+    free(m);
+}
+
+static void amf3__kvmap_index_insert(struct amf3_kvmap *m, int idx) {
+    unsigned int mask = m->nslot - 1;
+    unsigned int i = m->entries[idx].hash & mask;
+    while (m->slots[i])
+	i = (i + 1) & mask;
+    m->slots[i] = idx + 1;
+}
+
+static int amf3__kvmap_reindex(struct amf3_kvmap *m, int nslot) {
+    int *slots = m->arena
+	? arena_calloc(m->arena, nslot, sizeof(int))
+	: CALLOC(nslot, int);
+    if (!slots)
+	return -1;
+    if (!m->arena)
+	free(m->slots);
+    m->slots = slots;
+    m->nslot = nslot;
+    int i;
+    for (i = 0; i < m->count; i++)
+	amf3__kvmap_index_insert(m, i);
+    return 0;
+}
+
+static struct amf3_kv *amf3__kvmap_find(struct amf3_kvmap *m,
+	AMF3Value key, unsigned int hash) {
+    int i;
+    if (!m->slots) {
+	for (i = 0; i < m->count; i++)
+	    if (m->entries[i].hash == hash &&
+		    amf3__string_equal(m->entries[i].key, key))
+		return &m->entries[i];
+	return NULL;
+    }
+    unsigned int mask = m->nslot - 1;
+    int slot;
+    for (i = hash & mask; (slot = m->slots[i]) != 0; i = (i + 1) & mask)
+	if (m->entries[slot - 1].hash == hash &&
+		amf3__string_equal(m->entries[slot - 1].key, key))
+	    return &m->entries[slot - 1];
     return NULL;
 }
 
-static void *amf3__release_cb(
-	List list, int idx, void *INLIST, void *unused) {
-    amf3_release((AMF3Value)INLIST);
+static AMF3Value amf3__kvmap_get(struct amf3_kvmap *m, AMF3Value key) {
+    struct amf3_kv *kv = amf3__kvmap_find(m, key,
+	    amf3__hash_string(AMF3_HASH_SEED, key));
+    return kv ? kv->value : NULL;
+}
+
+static int amf3__kvmap_set(struct amf3_kvmap *m, AMF3Value key, AMF3Value value) {
+    unsigned int hash = amf3__hash_string(AMF3_HASH_SEED, key);
+    struct amf3_kv *kv = amf3__kvmap_find(m, key, hash);
+    if (kv) {
+	if (kv->value != value) {
+	    amf3_retain(value);
+	    amf3_release(kv->value);
+	    kv->value = value;
+	}
+	return 0;
+    }
+
+    if (m->count == m->nalloc) {
+	int nalloc = m->nalloc ? m->nalloc << 1 : 4;
+	struct amf3_kv *entries = m->arena
+	    ? arena_realloc(m->arena, m->entries,
+		    m->nalloc * sizeof(struct amf3_kv),
+		    nalloc * sizeof(struct amf3_kv))
+	    : realloc(m->entries, nalloc * sizeof(struct amf3_kv));
+	if (!entries)
+	    return -1;
+	m->entries = entries;
+	m->nalloc = nalloc;
+    }
+    kv = &m->entries[m->count];
+    kv->key = amf3_retain(key);
+    kv->value = amf3_retain(value);
+    kv->hash = hash;
+    m->count++;
+
+    // small maps are scanned, larger ones get an index at load <= 1/2
+    if (m->count > AMF3_KVMAP_LINEAR_MAX &&
+	    (!m->slots || m->count * 2 > m->nslot) &&
+	    amf3__kvmap_reindex(m,
+		m->nslot ? m->nslot << 1 : 4 * AMF3_KVMAP_LINEAR_MAX) == 0)
+	return 0;
+    if (m->slots)
+	amf3__kvmap_index_insert(m, m->count - 1);
+    return 0;
+}
+
+/* Plugins by class name.  A table is never changed once published:
+ * registering builds a new one and swaps it in, so lookups need no lock.
+ * Replaced tables and registered plugins are kept, since a reader may still
+ * be using them. */
+struct amf3_plugin_table {
+    int nslot;			/* power of 2, at least twice `count' */
+    int count;
+    unsigned int *hashes;
+    const struct amf3_plugin_parser **slots;
+    struct amf3_plugin_table *replaced;
+};
+
+static struct amf3_plugin_table *g_plugins;
+static pthread_mutex_t g_plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct amf3_plugin_table *amf3__plugin_table_new(int count) {
+    struct amf3_plugin_table *t = CALLOC(1, struct amf3_plugin_table);
+    if (!t)
+	return NULL;
+    t->nslot = 16;
+    while (t->nslot < count * 2)
+	t->nslot <<= 1;
+    t->hashes = CALLOC(t->nslot, unsigned int);
+    t->slots = CALLOC(t->nslot, const struct amf3_plugin_parser *);
+    if (!t->hashes || !t->slots) {
+	free(t->hashes);
+	free(t->slots);
+	free(t);
+	return NULL;
+    }
+    return t;
+}
+
+static void amf3__plugin_table_insert(struct amf3_plugin_table *t,
+	const struct amf3_plugin_parser *pp) {
+    unsigned int h = amf3__hash_bytes(AMF3_HASH_SEED,
+	    pp->classname, strlen(pp->classname));
+    unsigned int mask = t->nslot - 1, i = h & mask;
+    while (t->slots[i])
+	i = (i + 1) & mask;
+    t->hashes[i] = h;
+    t->slots[i] = pp;
+    t->count++;
+}
+
+static const struct amf3_plugin_parser *amf3__plugin_table_find(
+	struct amf3_plugin_table *t, const char *classname, int len) {
+    unsigned int h = amf3__hash_bytes(AMF3_HASH_SEED, classname, len);
+    unsigned int mask = t->nslot - 1, i;
+    for (i = h & mask; t->slots[i]; i = (i + 1) & mask)
+	if (t->hashes[i] == h &&
+		strncmp(t->slots[i]->classname, classname, len) == 0 &&
+		t->slots[i]->classname[len] == '\0')
+	    return t->slots[i];
     return NULL;
 }
 
+/* the current table; the first call publishes the built-in plugins. */
+static struct amf3_plugin_table *amf3__plugins() {
+    struct amf3_plugin_table *t = __atomic_load_n(&g_plugins, __ATOMIC_ACQUIRE);
+    if (t)
+	return t;
+    pthread_mutex_lock(&g_plugins_lock);
+    if (!(t = g_plugins)) {
+	int i, n = 0;
+	while (g_plugin_parsers[n].classname)
+	    n++;
+	if ((t = amf3__plugin_table_new(n)) != NULL) {
+	    for (i = 0; i < n; i++)
+		amf3__plugin_table_insert(t, &g_plugin_parsers[i]);
+	    __atomic_store_n(&g_plugins, t, __ATOMIC_RELEASE);
+	}
+    }
+    pthread_mutex_unlock(&g_plugins_lock);
+    return t;
+}
+
+static const struct amf3_plugin_parser *
+amf3__find_plugin(const char *classname, int len) {
+    struct amf3_plugin_table *t = amf3__plugins();
+    return t ? amf3__plugin_table_find(t, classname, len) : NULL;
+}
+
+const struct amf3_plugin_parser *amf3_plugin_find(const char *classname,
+	int length) {
+    return amf3__find_plugin(classname, length);
+}
+
+int amf3_plugin_register(const struct amf3_plugin_parser *pp) {
+    assert(pp && pp->classname && pp->handler && pp->freefunc &&
+	    pp->serializefunc);
+    if (!amf3__plugins())
+	return -1;
+    struct amf3_plugin_parser *copy = ALLOC(struct amf3_plugin_parser, 1);
+    char *classname = strdup(pp->classname);
+    if (!copy || !classname) {
+	free(copy);
+	free(classname);
+	return -1;
+    }
+    *copy = *pp;
+    copy->classname = classname;
+
+    pthread_mutex_lock(&g_plugins_lock);
+    struct amf3_plugin_table *old = g_plugins, *t = NULL;
+    if (amf3__plugin_table_find(old, classname, strlen(classname))) {
+	LOG(LOG_ERROR, "%s: class '%s' already registered\n",
+		__func__, classname);
+    } else if ((t = amf3__plugin_table_new(old->count + 1)) != NULL) {
+	int i;
+	for (i = 0; i < old->nslot; i++)
+	    if (old->slots[i])
+		amf3__plugin_table_insert(t, old->slots[i]);
+	amf3__plugin_table_insert(t, copy);
+	t->replaced = old;
+	__atomic_store_n(&g_plugins, t, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_plugins_lock);
+    if (!t) {
+	free(copy);
+	free(classname);
+	return -1;
+    }
+    return 0;
+}
+
 static const struct amf3_plugin_parser *
 amf3__find_plugin_parser(AMF3Value classname) {
-    int i;
-    for (i = 0; g_plugin_parsers[i].classname; i++)
-	if (strcmp(g_plugin_parsers[i].classname,
-		    amf3_string_cstr(classname)) == 0)
-	    return &g_plugin_parsers[i];
-    return NULL;
+    return amf3__find_plugin(amf3_string_cstr(classname),
+	    amf3_string_len(classname));
+}
+
+/* The plugin of externalizable traits is resolved once when the traits are
+ * created.  Traits made before their class was registered fall back to a
+ * lookup, which is not cached since the traits may be shared across threads.
+ */
+static const struct amf3_plugin_parser *amf3__traits_plugin(AMF3Value traits) {
+    if (traits->v.traits.plugin)
+	return traits->v.traits.plugin;
+    return amf3__find_plugin_parser(traits->v.traits.type);
 }
 
 static void amf3__free_value(struct amf3_value *v) {
@@ -132,25 +470,30 @@ static void amf3__free_value(struct amf3_value *v) {
 	case AMF3_XMLDOC:
 	case AMF3_XML:
 	case AMF3_BYTEARRAY:
-	    free(v->v.binary.data);
+	    if (!(v->flags & AMF3_VALUE_BORROWED))
+		free(v->v.binary.data);
 	    break;
 
 	case AMF3_ARRAY:
-	    list_foreach(v->v.array.assoc_list, amf3__kv_release_cb, NULL);
-	    list_foreach(v->v.array.dense_list, amf3__release_cb, NULL);
-	    list_free(v->v.array.assoc_list);
-	    list_free(v->v.array.dense_list);
+	    amf3__kvmap_free(v->v.array.assoc);
+	    {
+		int i;
+		for (i = 0; i < v->v.array.ndense; i++)
+		    amf3_release(v->v.array.dense[i]);
+		free(v->v.array.dense);
+	    }
 	    break;
 
 	case AMF3_OBJECT:
 	    if (v->v.object.traits->v.traits.externalizable) {
-		const struct amf3_plugin_parser *pp = amf3__find_plugin_parser(
-			v->v.object.traits->v.traits.type);
-		if (pp)
+		const struct amf3_plugin_parser *pp =
+		    amf3__traits_plugin(v->v.object.traits);
+		// NULL if its plugin failed before producing anything
+		if (pp && v->v.object.m.external_ctx)
 		    pp->freefunc(v->v.object.m.external_ctx);
-		else {
-		    LOG(LOG_ERROR, "%s: cannot free external object of type '%s'\n",
-			    amf3_string_cstr(v->v.object.traits->v.traits.type));
+		else if (!pp) {
+		    LOG(LOG_ERROR, "%s: cannot free external object of type '%.*s'\n",
+			    __func__, STRARG(v->v.object.traits->v.traits.type));
 		    return;
 		}
 	    } else {
@@ -160,9 +503,7 @@ static void amf3__free_value(struct amf3_value *v) {
 			amf3_release(v->v.object.m.i.member_values[i]);
 		free(v->v.object.m.i.member_values);
 
-		list_foreach(v->v.object.m.i.dynmemb_list,
-			amf3__kv_release_cb, NULL);
-		list_free(v->v.object.m.i.dynmemb_list);
+		amf3__kvmap_free(v->v.object.m.i.dynmemb);
 	    }
 	    amf3_release(v->v.object.traits);
 	    break;
@@ -170,10 +511,10 @@ static void amf3__free_value(struct amf3_value *v) {
 	case AMF3_TRAITS:
 	    amf3_release(v->v.traits.type);
 	    if (v->v.traits.nmemb > 0) {
-		amf3_release(v);
 		int i;
 		for (i = 0; i < v->v.traits.nmemb; i++)
-		    amf3_release(v->v.traits.members[i]);
+		    if (v->v.traits.members[i])
+			amf3_release(v->v.traits.members[i]);
 		free(v->v.traits.members);
 	    }
 	    break;
@@ -185,55 +526,95 @@ static void amf3__free_value(struct amf3_value *v) {
     free(v);
 }
 
+static void amf3__free_external_cb(void *OBJ) {
+    AMF3Value obj = (AMF3Value)OBJ;
+    const struct amf3_plugin_parser *pp =
+	amf3__traits_plugin(obj->v.object.traits);
+    if (pp && obj->v.object.m.external_ctx)
+	pp->freefunc(obj->v.object.m.external_ctx);
+}
+
 AMF3Value amf3_retain(AMF3Value v) {
     assert(v);
-    v->retain_count++;
+    if (v->flags & AMF3_VALUE_NOREFCOUNT)
+	return v;
+    if (amf3__refcount_atomic(v))
+	__atomic_fetch_add(&v->retain_count, 1, __ATOMIC_RELAXED);
+    else
+	v->retain_count++;
     return v;
 }
 
 void amf3_release(AMF3Value v) {
-    if (!--v->retain_count)
+    if (v->flags & AMF3_VALUE_NOREFCOUNT)
+	return;
+    // the last release must see every write made before the others
+    if (amf3__refcount_atomic(v) ?
+	    !__atomic_sub_fetch(&v->retain_count, 1, __ATOMIC_ACQ_REL) :
+	    !--v->retain_count)
 	amf3__free_value(v);
 }
 
 AMF3Value amf3_new_undefined() {
-    return amf3__new_value(AMF3_UNDEFINED);
+    return amf3__new_value(NULL, AMF3_UNDEFINED);
 }
 
 AMF3Value amf3_new_null() {
-    return amf3__new_value(AMF3_NULL);
+    return amf3__new_value(NULL, AMF3_NULL);
 }
 
 AMF3Value amf3_new_false() {
-    return amf3__new_value(AMF3_FALSE);
+    return amf3__new_value(NULL, AMF3_FALSE);
 }
 
 AMF3Value amf3_new_true() {
-    return amf3__new_value(AMF3_TRUE);
+    return amf3__new_value(NULL, AMF3_TRUE);
 }
 
-AMF3Value amf3_new_integer(int value) {
-    AMF3Value v = amf3__new_value(AMF3_INTEGER);
+static struct amf3_value *amf3__new_integer(Arena arena, int value) {
+    if (value >= AMF3_SMALLINT_MIN && value <= AMF3_SMALLINT_MAX)
+	return &g_smallints[value - AMF3_SMALLINT_MIN];
+    AMF3Value v = amf3__new_value(arena, AMF3_INTEGER);
     if (v)
 	v->v.integer = value;
     return v;
 }
 
-AMF3Value amf3_new_double(double value) {
-    AMF3Value v = amf3__new_value(AMF3_DOUBLE);
+AMF3Value amf3_new_integer(int value) {
+    return amf3__new_integer(NULL, value);
+}
+
+static struct amf3_value *amf3__new_double(Arena arena, double value) {
+    AMF3Value v = amf3__new_value(arena, AMF3_DOUBLE);
     if (v)
 	v->v.real = value;
     return v;
 }
 
-static struct amf3_value *amf3__new_binary(
+AMF3Value amf3_new_double(double value) {
+    return amf3__new_double(NULL, value);
+}
+
+static struct amf3_value *amf3__new_binary_view(Arena arena,
+	char type, const char *data, int length) {
+    struct amf3_value *v = amf3__new_value(arena, type);
+    if (v) {
+	v->flags |= AMF3_VALUE_BORROWED;
+	v->v.binary.length = length;
+	v->v.binary.data = (char *)data;
+    }
+    return v;
+}
+
+static struct amf3_value *amf3__new_binary(Arena arena,
 	char type, const char *data, int length) {
-    struct amf3_value *v = amf3__new_value(type);
+    struct amf3_value *v = amf3__new_value(arena, type);
     if (v) {
 	v->v.binary.length = length;
-	v->v.binary.data = malloc(length + 1);
+	v->v.binary.data = amf3__alloc(arena, length + 1);
 	if (!v->v.binary.data) {
-	    amf3__free_value(v);
+	    if (!arena)
+		free(v);
 	    return NULL;
 	}
 	memcpy(v->v.binary.data, data, length);
@@ -242,8 +623,79 @@ static struct amf3_value *amf3__new_binary(
     return v;
 }
 
+static struct {
+    pthread_mutex_t lock;
+    struct amf3_value **slots;
+    int nslot;
+    int count;
+} g_intern = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+/* must hold g_intern.lock. returns 0 if success. */
+static int amf3__intern_grow(void) {
+    // at most half full, and capped by AMF3_INTERN_MAX_ENTRIES
+    size_t nslot = g_intern.nslot ? (size_t)g_intern.nslot * 2 : 256;
+    assert(nslot <= 2 * (size_t)AMF3_INTERN_MAX_ENTRIES);
+    struct amf3_value **slots = CALLOC(nslot, struct amf3_value *);
+    if (!slots)
+	return -1;
+    int i;
+    for (i = 0; i < g_intern.nslot; i++) {
+	AMF3Value s = g_intern.slots[i];
+	if (!s)
+	    continue;
+	unsigned int j = amf3__hash_string(AMF3_HASH_SEED, s) & (nslot - 1);
+	while (slots[j])
+	    j = (j + 1) & (nslot - 1);
+	slots[j] = s;
+    }
+    free(g_intern.slots);
+    g_intern.slots = slots;
+    g_intern.nslot = nslot;
+    return 0;
+}
+
+AMF3Value amf3_intern(const char *string, int length) {
+    assert(string && length >= 0);
+    if (length > AMF3_INTERN_MAX_LENGTH)
+	return amf3_new_string(string, length);
+
+    // hash the same way `amf3__hash_string' does for a value
+    unsigned int h = amf3__hash_bytes(AMF3_HASH_SEED, &length, sizeof(int));
+    h = amf3__hash_bytes(h, string, length);
+
+    AMF3Value v = NULL;
+    pthread_mutex_lock(&g_intern.lock);
+    if (g_intern.nslot > 0) {
+	unsigned int mask = g_intern.nslot - 1, i;
+	for (i = h & mask; (v = g_intern.slots[i]) != NULL; i = (i + 1) & mask)
+	    if (v->v.binary.length == length &&
+		    memcmp(v->v.binary.data, string, length) == 0)
+		break;
+    }
+    if (!v && g_intern.count < AMF3_INTERN_MAX_ENTRIES &&
+	    (2 * (g_intern.count + 1) <= g_intern.nslot ||
+	     amf3__intern_grow() == 0) &&
+	    (v = amf3__new_binary(NULL, AMF3_STRING, string, length)) != NULL) {
+	v->flags |= AMF3_VALUE_IMMORTAL | AMF3_VALUE_INTERNED;
+	unsigned int mask = g_intern.nslot - 1, i = h & mask;
+	while (g_intern.slots[i])
+	    i = (i + 1) & mask;
+	g_intern.slots[i] = v;
+	g_intern.count++;
+    }
+    pthread_mutex_unlock(&g_intern.lock);
+    return v ? v : amf3_new_string(string, length);
+}
+
+AMF3Value amf3_intern_value(AMF3Value v) {
+    assert(v && v->type == AMF3_STRING);
+    if (v->flags & AMF3_VALUE_INTERNED)
+	return v;
+    return amf3_intern(v->v.binary.data, v->v.binary.length);
+}
+
 AMF3Value amf3_new_string(const char *string, int length) {
-    return amf3__new_binary(AMF3_STRING, string, length);
+    return amf3__new_binary(NULL, AMF3_STRING, string, length);
 }
 
 AMF3Value amf3_new_string_utf8(const char *utf8) {
@@ -251,28 +703,39 @@ AMF3Value amf3_new_string_utf8(const char *utf8) {
 }
 
 AMF3Value amf3_new_xmldoc(const char *doc, int length) {
-    return amf3__new_binary(AMF3_XMLDOC, doc, length);
+    return amf3__new_binary(NULL, AMF3_XMLDOC, doc, length);
 }
 
 AMF3Value amf3_new_xml(const char *doc, int length) {
-    return amf3__new_binary(AMF3_XML, doc, length);
+    return amf3__new_binary(NULL, AMF3_XML, doc, length);
 }
 
 AMF3Value amf3_new_bytearray(const char *bytes, int length) {
-    return amf3__new_binary(AMF3_BYTEARRAY, bytes, length);
+    return amf3__new_binary(NULL, AMF3_BYTEARRAY, bytes, length);
 }
 
-AMF3Value amf3_new_date(double date) {
-    AMF3Value v = amf3__new_value(AMF3_DATE);
+static struct amf3_value *amf3__new_date(Arena arena, double date) {
+    AMF3Value v = amf3__new_value(arena, AMF3_DATE);
     if (v)
 	v->v.date.value = date;
     return v;
 }
 
+AMF3Value amf3_new_date(double date) {
+    return amf3__new_date(NULL, date);
+}
+
 int amf3_string_cmp(AMF3Value a, AMF3Value b) {
     assert(a && a->type == AMF3_STRING);
     assert(b && b->type == AMF3_STRING);
-    return strcmp(a->v.binary.data, b->v.binary.data);
+    if (a == b)
+	return 0;
+    // borrowed strings are not terminated, compare by length instead
+    int alen = a->v.binary.length, blen = b->v.binary.length;
+    int r = memcmp(a->v.binary.data, b->v.binary.data, alen < blen ? alen : blen);
+    if (r != 0)
+	return r;
+    return alen - blen;
 }
 
 int amf3_string_len(AMF3Value v) {
@@ -297,20 +760,28 @@ const char *amf3_binary_data(AMF3Value v) {
     return v->v.binary.data;
 }
 
-static struct amf3_value *amf3__new_traits(AMF3Value type,
+AMF3Value amf3_binary_copy(AMF3Value v) {
+    assert(v && (v->type == AMF3_BYTEARRAY || v->type == AMF3_XML
+		|| v->type == AMF3_XMLDOC || v->type == AMF3_STRING));
+    return amf3__new_binary(NULL, v->type, v->v.binary.data, v->v.binary.length);
+}
+
+static struct amf3_value *amf3__new_traits(Arena arena, AMF3Value type,
 	char externalizable, char dynamic, int nmemb) {
-    LOG(LOG_DEBUG, "[TRAITS][%s%s](%d)%s\n",
+    LOG(LOG_DEBUG, "[TRAITS][%s%s](%d)%.*s\n",
 	    externalizable ? "E" : " ",
 	    dynamic ? "D" : " ",
-	    nmemb, amf3_string_cstr(type));
-    struct amf3_value *v = amf3__new_value(AMF3_TRAITS);
+	    nmemb, STRARG(type));
+    struct amf3_value *v = amf3__new_value(arena, AMF3_TRAITS);
     if (v) {
 	v->v.traits.externalizable = externalizable;
 	v->v.traits.dynamic = dynamic;
 	if (nmemb > 0) {
-	    struct amf3_value **list = ALLOC(struct amf3_value *, nmemb);
+	    struct amf3_value **list = amf3__alloc(arena,
+		    sizeof(struct amf3_value *) * nmemb);
 	    if (!list) {
-		amf3__free_value(v);
+		if (!arena)
+		    free(v);
 		return NULL;
 	    }
 	    memset(list, 0, sizeof(*list) * nmemb);
@@ -318,6 +789,8 @@ static struct amf3_value *amf3__new_traits(AMF3Value type,
 	    v->v.traits.nmemb = nmemb;
 	}
 	v->v.traits.type = amf3_retain(type);
+	v->v.traits.plugin = externalizable ?
+	    amf3__find_plugin_parser(type) : NULL;
     }
     return v;
 }
@@ -327,88 +800,121 @@ static void amf3__traits_member_set(
     assert(traits && traits->type == AMF3_TRAITS);
     assert(key && key->type == AMF3_STRING);
     assert(idx < traits->v.traits.nmemb);
+    assert(amf3__mutable(traits));
     struct amf3_value **list = traits->v.traits.members;
     if (list[idx] == key)
 	return;
     if (list[idx] != NULL)
 	amf3_release(list[idx]);
     list[idx] = amf3_retain(key);
+    traits->v.traits.hash = 0;
 }
 
-AMF3Value amf3_new_array() {
-    AMF3Value v = amf3__new_value(AMF3_ARRAY);
+static struct amf3_value *amf3__new_array(Arena arena) {
+    AMF3Value v = amf3__new_value(arena, AMF3_ARRAY);
     if (v) {
-	v->v.array.assoc_list = list_new();
-	v->v.array.dense_list = list_new();
+	v->v.array.assoc = amf3__kvmap_new(arena);
+	if (!v->v.array.assoc) {
+	    if (!arena)
+		free(v);
+	    return NULL;
+	}
     }
     return v;
 }
 
+AMF3Value amf3_new_array() {
+    return amf3__new_array(NULL);
+}
+
+/* makes room for at least `n' dense elements. */
+static int amf3__array_reserve(AMF3Value a, int n) {
+    struct amf3_array *arr = &a->v.array;
+    if (n <= arr->dense_alloc)
+	return 0;
+    Arena arena = arr->assoc->arena;
+    AMF3Value *dense = arena
+	? arena_realloc(arena, arr->dense,
+		arr->dense_alloc * sizeof(AMF3Value), n * sizeof(AMF3Value))
+	: realloc(arr->dense, n * sizeof(AMF3Value));
+    if (!dense)
+	return -1;
+    arr->dense = dense;
+    arr->dense_alloc = n;
+    return 0;
+}
+
 void amf3_array_push(AMF3Value a, AMF3Value v) {
     assert(a->type == AMF3_ARRAY);
-    list_push(a->v.array.dense_list, amf3_retain(v));
+    assert(amf3__mutable(a));
+    if (!amf3__force(a))
+	return;
+    struct amf3_array *arr = &a->v.array;
+    if (arr->ndense == arr->dense_alloc &&
+	    amf3__array_reserve(a, arr->dense_alloc ? arr->dense_alloc << 1 : 8))
+	return;
+    arr->dense[arr->ndense++] = amf3_retain(v);
 }
 
-static void *amf3__kv_replace_cb(List list, int idx, void *INL, void *REP) {
-    struct amf3_kv *inlist = (struct amf3_kv *)INL;
-    struct amf3_kv *repas = (struct amf3_kv *)REP;
-    if (amf3_string_cmp(inlist->key, repas->key) == 0) {
-	if (inlist->value != repas->value) {
-	    amf3_retain(repas->value);
-	    amf3_release(inlist->value);
-	    inlist->value = repas->value;
-	}
-	return repas; // a non-null pointer will do
-    }
-    return NULL;
+int amf3_array_len(AMF3Value a) {
+    assert(a && a->type == AMF3_ARRAY);
+    if (!amf3__force(a))
+	return 0;
+    return a->v.array.ndense;
 }
 
-static void *amf3__kv_get_cb(List list, int idx, void *INLIST, void *KEY) {
-    struct amf3_kv *inlist = (struct amf3_kv *)INLIST;
-    AMF3Value key = (AMF3Value)KEY;
-    if (amf3_string_cmp(inlist->key, key) == 0)
-	return inlist->value;
-    return NULL;
+AMF3Value amf3_array_get(AMF3Value a, int idx) {
+    assert(a && a->type == AMF3_ARRAY);
+    if (!amf3__force(a))
+	return NULL;
+    if (idx < 0 || idx >= a->v.array.ndense)
+	return NULL;
+    return a->v.array.dense[idx];
 }
 
 void amf3_array_assoc_set(AMF3Value a, AMF3Value key, AMF3Value value) {
     assert(a && a->type == AMF3_ARRAY);
     assert(key && key->type == AMF3_STRING);
-    struct amf3_kv kvfind = {key, value};
-    if (!list_foreach(a->v.array.assoc_list, amf3__kv_replace_cb, &kvfind)) {
-	struct amf3_kv *kv = ALLOC(struct amf3_kv, 1);
-	if (!kv)
-	    return;
-	kv->key = amf3_retain(key);
-	kv->value = amf3_retain(value);
-	list_push(a->v.array.assoc_list, kv);
-    }
+    assert(amf3__mutable(a));
+    if (!amf3__force(a))
+	return;
+    amf3__kvmap_set(a->v.array.assoc, key, value);
 }
 
 AMF3Value amf3_array_assoc_get(AMF3Value a, AMF3Value key) {
     assert(a && a->type == AMF3_ARRAY);
     assert(key && key->type == AMF3_STRING);
-    return list_foreach(a->v.array.assoc_list, amf3__kv_get_cb, key);
+    if (!amf3__force(a))
+	return NULL;
+    return amf3__kvmap_get(a->v.array.assoc, key);
 }
 
-static AMF3Value amf3__new_object_direct(
-	AMF3Value traits, AMF3Value *members, List dynmemb_list) {
+static AMF3Value amf3__new_object_direct(Arena arena,
+	AMF3Value traits, AMF3Value *members) {
     assert(traits->type == AMF3_TRAITS);
-    AMF3Value v = amf3__new_value(AMF3_OBJECT);
+    AMF3Value v = amf3__new_value(arena, AMF3_OBJECT);
     if (!v)
 	return NULL;
     int nmemb = traits->v.traits.nmemb;
     if (nmemb > 0 && members == NULL) {
-	members = ALLOC(AMF3Value, nmemb);
+	members = amf3__alloc(arena, sizeof(AMF3Value) * nmemb);
 	if (!members) {
-	    amf3_release(v);
+	    if (!arena)
+		free(v);
 	    return NULL;
 	}
 	memset(members, 0, sizeof(AMF3Value) * nmemb);
     }
     v->v.object.traits = amf3_retain(traits);
     v->v.object.m.i.member_values = members;
-    v->v.object.m.i.dynmemb_list = dynmemb_list;
+    v->v.object.m.i.dynmemb = amf3__kvmap_new(arena);
+    if (!v->v.object.m.i.dynmemb) {
+	if (!arena) {
+	    free(members);
+	    free(v);
+	}
+	return NULL;
+    }
     return v;
 }
 
@@ -417,27 +923,34 @@ AMF3Value amf3_new_object(AMF3Value type, char dynamic,
     assert(!type || (type && type->type == AMF3_STRING));
     assert(nmemb >= 0);
 
-    AMF3Value traits = amf3__new_traits(
-	    type ? type : amf3_new_string_utf8(""),
-	    0, dynamic, nmemb);
+    AMF3Value anonymous = NULL;
+    if (!type && !(type = anonymous = amf3_new_string_utf8("")))
+	return NULL;
+    AMF3Value traits = amf3__new_traits(NULL, type, 0, dynamic, nmemb);
+    if (anonymous)
+	amf3_release(anonymous);
     if (!traits)
 	return NULL;
     int i;
     for (i = 0; i < nmemb; i++)
 	amf3__traits_member_set(traits, i, member_names[i]);
 
-    AMF3Value v = amf3__new_object_direct(traits, NULL, list_new());
+    AMF3Value v = amf3__new_object_direct(NULL, traits, NULL);
     amf3_release(traits);
     return v;
 }
 
 AMF3Value amf3_object_traits_get(AMF3Value o) {
     assert(o && o->type == AMF3_OBJECT);
+    if (!amf3__force(o))
+	return NULL;
     return o->v.object.traits;
 }
 
 void *amf3_object_external_get(AMF3Value o) {
     assert(o && o->type == AMF3_OBJECT);
+    if (!amf3__force(o))
+	return NULL;
     assert(o->v.object.traits->v.traits.externalizable);
     return o->v.object.m.external_ctx;
 }
@@ -445,19 +958,25 @@ void *amf3_object_external_get(AMF3Value o) {
 AMF3Value amf3_object_prop_get(AMF3Value o, AMF3Value key) {
     assert(o && o->type == AMF3_OBJECT);
     assert(key && key->type == AMF3_STRING);
+    if (!amf3__force(o))
+	return NULL;
     struct amf3_traits *traits = &o->v.object.traits->v.traits;
     if (traits->externalizable) {
-	// TODO
+	const struct amf3_plugin_parser *pp =
+	    amf3__traits_plugin(o->v.object.traits);
+	if (pp && pp->getfunc && o->v.object.m.external_ctx)
+	    return pp->getfunc(o->v.object.m.external_ctx,
+		    amf3_string_cstr(key), amf3_string_len(key));
 	return NULL;
     }
     if (traits->nmemb > 0) {
 	int i;
 	for (i = 0; i < traits->nmemb; i++)
-	    if (amf3_string_cmp(key, traits->members[i]) == 0)
+	    if (amf3__string_equal(key, traits->members[i]))
 		return o->v.object.m.i.member_values[i];
     }
     if (traits->dynamic)
-	return list_foreach(o->v.object.m.i.dynmemb_list, amf3__kv_get_cb, key);
+	return amf3__kvmap_get(o->v.object.m.i.dynmemb, key);
     return NULL;
 }
 
@@ -465,6 +984,9 @@ void amf3_object_prop_set(AMF3Value o, AMF3Value key, AMF3Value value) {
     assert(o && o->type == AMF3_OBJECT);
     assert(key && key->type == AMF3_STRING);
     assert(value);
+    assert(amf3__mutable(o));
+    if (!amf3__force(o))
+	return;
     struct amf3_traits *traits = &o->v.object.traits->v.traits;
     if (traits->externalizable) {
 	// TODO
@@ -474,7 +996,7 @@ void amf3_object_prop_set(AMF3Value o, AMF3Value key, AMF3Value value) {
 	AMF3Value *member_values = o->v.object.m.i.member_values;
 	int i;
 	for (i = 0; i < traits->nmemb; i++)
-	    if (amf3_string_cmp(key, traits->members[i]) == 0) {
+	    if (amf3__string_equal(key, traits->members[i])) {
 		if (member_values[i] == NULL)
 		    member_values[i] = amf3_retain(value);
 		else if (member_values[i] != value) {
@@ -485,49 +1007,124 @@ void amf3_object_prop_set(AMF3Value o, AMF3Value key, AMF3Value value) {
 		return;
 	    }
     }
-    if (traits->dynamic) {
-	struct amf3_kv kvfind = {key, value};
-	if (!list_foreach(o->v.object.m.i.dynmemb_list,
-		    amf3__kv_replace_cb, &kvfind)) {
-	    struct amf3_kv *kv = ALLOC(struct amf3_kv, 1);
-	    if (!kv)
-		return;
-	    kv->key = amf3_retain(key);
-	    kv->value = amf3_retain(value);
-	    list_push(o->v.object.m.i.dynmemb_list, kv);
+    if (traits->dynamic)
+	amf3__kvmap_set(o->v.object.m.i.dynmemb, key, value);
+}
+
+static unsigned int amf3__traits_hash(AMF3Value traits);
+static int amf3__traits_equal(AMF3Value a, AMF3Value b);
+
+void amf3_accessor_init(struct amf3_accessor *acc,
+	AMF3Value classname, AMF3Value key) {
+    assert(!classname || classname->type == AMF3_STRING);
+    assert(key && key->type == AMF3_STRING);
+    memset(acc, 0, sizeof(*acc));
+    acc->classname = classname ? amf3_retain(classname) : NULL;
+    acc->key = amf3_retain(key);
+    acc->slot = AMF3_ACCESSOR_NONE;
+}
+
+void amf3_accessor_cleanup(struct amf3_accessor *acc) {
+    if (acc->classname)
+	amf3_release(acc->classname);
+    if (acc->key)
+	amf3_release(acc->key);
+    if (acc->traits)
+	amf3_release(acc->traits);
+    memset(acc, 0, sizeof(*acc));
+}
+
+static void amf3__accessor_resolve(struct amf3_accessor *acc, AMF3Value traits) {
+    struct amf3_traits *t = &traits->v.traits;
+    unsigned int hash = amf3__traits_hash(traits);
+    // an equal traits instance, e.g. from the next message, keeps the slot
+    int same = acc->traits && acc->traits_hash == hash &&
+	amf3__traits_equal(acc->traits, traits);
+    amf3_retain(traits);
+    if (acc->traits)
+	amf3_release(acc->traits);
+    acc->traits = traits;
+    acc->traits_hash = hash;
+    if (same)
+	return;
+
+    acc->slot = AMF3_ACCESSOR_NONE;
+    if (acc->classname && !amf3__string_equal(acc->classname, t->type))
+	return;
+    if (t->externalizable) {
+	acc->slot = AMF3_ACCESSOR_GENERIC;
+	return;
+    }
+    int i;
+    for (i = 0; i < t->nmemb; i++)
+	if (amf3__string_equal(acc->key, t->members[i])) {
+	    acc->slot = i;
+	    return;
 	}
+    if (t->dynamic)
+	acc->slot = AMF3_ACCESSOR_DYNAMIC;
+}
+
+AMF3Value amf3_accessor_get(struct amf3_accessor *acc, AMF3Value o) {
+    assert(o && o->type == AMF3_OBJECT);
+    if (!amf3__force(o))
+	return NULL;
+    AMF3Value traits = o->v.object.traits;
+    if (traits != acc->traits || traits->v.traits.hash != acc->traits_hash)
+	amf3__accessor_resolve(acc, traits);
+    if (acc->slot >= 0)
+	return o->v.object.m.i.member_values[acc->slot];
+    switch (acc->slot) {
+	case AMF3_ACCESSOR_DYNAMIC:
+	    return amf3__kvmap_get(o->v.object.m.i.dynmemb, acc->key);
+
+	case AMF3_ACCESSOR_GENERIC:
+	    return amf3_object_prop_get(o, acc->key);
+
+	default:
+	    return NULL;
     }
 }
 
 AMF3Value amf3_traits_type_get(AMF3Value o) {
+    if (!amf3__force(o))
+	return NULL;
     struct amf3_traits *t = &o->v.object.traits->v.traits;
     return t->type;
 }
 
 int amf3_traits_is_externalizable(AMF3Value o) {
+    if (!amf3__force(o))
+	return 0;
     struct amf3_traits *t = &o->v.object.traits->v.traits;
     return t->externalizable ? 1 : 0;
 }
 
 int amf3_traits_is_dynamic(AMF3Value o) {
+    if (!amf3__force(o))
+	return 0;
     struct amf3_traits *t = &o->v.object.traits->v.traits;
     return t->dynamic ? 1 : 0;
 }
 
 int amf3_traits_num_members(AMF3Value o) {
+    if (!amf3__force(o))
+	return 0;
     struct amf3_traits *t = &o->v.object.traits->v.traits;
     return t->nmemb;
 }
 
 AMF3Value amf3_traits_member_name_get(AMF3Value o, int idx) {
+    if (!amf3__force(o))
+	return NULL;
     struct amf3_traits *t = &o->v.object.traits->v.traits;
     return t->members[idx];
 }
 
-static AMF3Value amf3__new_object_external_direct(
+static AMF3Value amf3__new_object_external_direct(Arena arena,
 	AMF3Value traits, void *external_ctx) {
     assert(traits->v.traits.externalizable);
-    AMF3Value v = amf3__new_value(AMF3_OBJECT);
+    AMF3Value v = amf3__new_value(arena, AMF3_OBJECT);
     if (!v)
 	return NULL;
     v->v.object.traits = amf3_retain(traits);
@@ -538,15 +1135,165 @@ static AMF3Value amf3__new_object_external_direct(
 AMF3Value amf3_new_object_external(AMF3Value type, void *external_ctx) {
     assert(type && type->type == AMF3_STRING);
 
-    AMF3Value traits = amf3__new_traits(type, 1, 0, 0);
+    AMF3Value traits = amf3__new_traits(NULL, type, 1, 0, 0);
     if (!traits)
 	return NULL;
 
-    AMF3Value v = amf3__new_object_external_direct(traits, external_ctx);
+    AMF3Value v = amf3__new_object_external_direct(NULL, traits, external_ctx);
     amf3_release(traits);
     return v;
 }
 
+static void amf3__kvmap_foreach(struct amf3_kvmap *m,
+	AMF3ValueIterFunc func, void *ctx) {
+    int i;
+    for (i = 0; i < m->count; i++) {
+	func(m->entries[i].key, ctx);
+	func(m->entries[i].value, ctx);
+    }
+}
+
+/* calls `func' on every value directly held by `v', traits included. */
+static void amf3__foreach_child(AMF3Value v, AMF3ValueIterFunc func, void *ctx) {
+    int i;
+    if (!amf3__force(v))
+	return;
+    switch (v->type) {
+	case AMF3_ARRAY:
+	    amf3__kvmap_foreach(v->v.array.assoc, func, ctx);
+	    for (i = 0; i < v->v.array.ndense; i++)
+		func(v->v.array.dense[i], ctx);
+	    break;
+
+	case AMF3_OBJECT:
+	    func(v->v.object.traits, ctx);
+	    if (v->v.object.traits->v.traits.externalizable) {
+		const struct amf3_plugin_parser *pp =
+		    amf3__traits_plugin(v->v.object.traits);
+		if (pp && pp->foreachfunc && v->v.object.m.external_ctx)
+		    pp->foreachfunc(v->v.object.m.external_ctx, func, ctx);
+	    } else {
+		for (i = 0; i < v->v.object.traits->v.traits.nmemb; i++)
+		    if (v->v.object.m.i.member_values[i])
+			func(v->v.object.m.i.member_values[i], ctx);
+		amf3__kvmap_foreach(v->v.object.m.i.dynmemb, func, ctx);
+	    }
+	    break;
+
+	case AMF3_TRAITS:
+	    func(v->v.traits.type, ctx);
+	    for (i = 0; i < v->v.traits.nmemb; i++)
+		if (v->v.traits.members[i])
+		    func(v->v.traits.members[i], ctx);
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+struct amf3_pin_ctx {
+    Arena arena;
+    int failed;
+    AMF3Value *marked;
+    int nmarked;
+    int nalloc;
+};
+
+static void amf3__pin_cb(AMF3Value v, void *CTX) {
+    struct amf3_pin_ctx *pc = (struct amf3_pin_ctx *)CTX;
+    switch (v->type) {
+	case AMF3_STRING:
+	case AMF3_XMLDOC:
+	case AMF3_XML:
+	case AMF3_BYTEARRAY:
+	    if (v->flags & AMF3_VALUE_BORROWED) {
+		Arena arena = (v->flags & AMF3_VALUE_ARENA) ? pc->arena : NULL;
+		assert(arena || !(v->flags & AMF3_VALUE_ARENA));
+		char *data = amf3__alloc(arena, v->v.binary.length + 1);
+		if (!data) {
+		    pc->failed = 1;
+		    return;
+		}
+		memcpy(data, v->v.binary.data, v->v.binary.length);
+		data[v->v.binary.length] = '\0';
+		v->v.binary.data = data;
+		v->flags &= ~AMF3_VALUE_BORROWED;
+	    }
+	    break;
+
+	case AMF3_ARRAY:
+	case AMF3_OBJECT:
+	case AMF3_TRAITS:
+	    // objects may be cyclic, remember what has been visited
+	    if (v->flags & AMF3_VALUE_MARK)
+		return;
+	    if (pc->nmarked == pc->nalloc) {
+		int nalloc = pc->nalloc ? pc->nalloc << 1 : 64;
+		AMF3Value *marked = realloc(pc->marked, nalloc * sizeof(AMF3Value));
+		if (!marked) {
+		    pc->failed = 1;
+		    return;
+		}
+		pc->marked = marked;
+		pc->nalloc = nalloc;
+	    }
+	    pc->marked[pc->nmarked++] = v;
+	    v->flags |= AMF3_VALUE_MARK;
+	    amf3__foreach_child(v, amf3__pin_cb, pc);
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+int amf3_pin(AMF3Value v, Arena arena) {
+    assert(amf3__mutable(v));
+    struct amf3_pin_ctx pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.arena = arena;
+    amf3__pin_cb(v, &pc);
+    int i;
+    for (i = 0; i < pc.nmarked; i++)
+	pc.marked[i]->flags &= ~AMF3_VALUE_MARK;
+    free(pc.marked);
+    return pc.failed ? -1 : 0;
+}
+
+static void amf3__freeze_cb(AMF3Value v, void *CTX) {
+    int *failed = (int *)CTX;
+    // immortals are shared already; frozen values also end cycles
+    if (v->flags & (AMF3_VALUE_IMMORTAL | AMF3_VALUE_FROZEN))
+	return;
+    switch (v->type) {
+	case AMF3_ARRAY:
+	case AMF3_OBJECT:
+	case AMF3_TRAITS:
+	    // nothing may be decoded or cached once readers share the tree
+	    if (!amf3__force(v)) {
+		*failed = 1;
+		return;
+	    }
+	    if (v->type == AMF3_TRAITS)
+		amf3__traits_hash(v);
+	    v->flags |= AMF3_VALUE_FROZEN;
+	    amf3__foreach_child(v, amf3__freeze_cb, failed);
+	    break;
+
+	default:
+	    v->flags |= AMF3_VALUE_FROZEN;
+	    break;
+    }
+}
+
+int amf3_freeze(AMF3Value v) {
+    assert(v);
+    int failed = 0;
+    amf3__freeze_cb(v, &failed);
+    return failed ? -1 : 0;
+}
+
 struct amf3_ref_table *amf3_ref_table_new() {
     struct amf3_ref_table *r = ALLOC(struct amf3_ref_table, 1);
     if (r) {
@@ -561,25 +1308,227 @@ struct amf3_ref_table *amf3_ref_table_new() {
     return r;
 }
 
-void amf3_ref_table_free(struct amf3_ref_table *r) {
-    assert(r);
-    if (r->refs) {
-	int i;
-	for (i = 0; i < r->nref; i++)
-	    amf3_release(r->refs[i]);
-	free(r->refs);
-    }
+#define AMF3_REF_INDEX_PREALLOC (AMF3_REF_TABLE_PREALLOC * 2)
+
+struct amf3_ref_table *amf3_ref_table_new_indexed() {
+    struct amf3_ref_table *r = amf3_ref_table_new();
+    if (r) {
+	r->hashes = ALLOC(unsigned int, r->nalloc);
+	r->nslot = AMF3_REF_INDEX_PREALLOC;
+	r->slots = CALLOC(r->nslot, int);
+	if (!r->hashes || !r->slots) {
+	    amf3_ref_table_free(r);
+	    return NULL;
+	}
+    }
+    return r;
+}
+
+/* serialize tables hold frozen values without a reference: they are shared
+ * by every thread serializing them, and the owner keeps them alive. */
+static AMF3Value amf3__ref_retain(struct amf3_ref_table *r, AMF3Value v) {
+    if (r->borrow_frozen && (v->flags & AMF3_VALUE_FROZEN))
+	return v;
+    return amf3_retain(v);
+}
+
+static void amf3__ref_release(struct amf3_ref_table *r, AMF3Value v) {
+    if (!r->borrow_frozen || !(v->flags & AMF3_VALUE_FROZEN))
+	amf3_release(v);
+}
+
+void amf3_ref_table_free(struct amf3_ref_table *r) {
+    assert(r);
+    if (r->refs) {
+	int i;
+	for (i = 0; i < r->nref; i++)
+	    amf3__ref_release(r, r->refs[i]);
+	free(r->refs);
+    }
+    if (r->hashes)
+	free(r->hashes);
+    if (r->slots)
+	free(r->slots);
     free(r);
 }
 
+void amf3_ref_table_reset(struct amf3_ref_table *r) {
+    int i;
+    for (i = 0; i < r->nref; i++)
+	amf3__ref_release(r, r->refs[i]);
+    r->nref = 0;
+    if (r->slots)
+	memset(r->slots, 0, r->nslot * sizeof(int));
+}
+
+static unsigned int amf3__hash_pointer(const void *p) {
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned int)x;
+}
+
+/* hash over everything that makes two traits interchangeable on the wire:
+ * class name, flags and member names. */
+static unsigned int amf3__traits_hash(AMF3Value traits) {
+    struct amf3_traits *t = &traits->v.traits;
+    if (t->hash)
+	return t->hash;
+    unsigned int h = AMF3_HASH_SEED;
+    char flags[2] = {t->externalizable ? 1 : 0, t->dynamic ? 1 : 0};
+    h = amf3__hash_bytes(h, flags, sizeof(flags));
+    h = amf3__hash_bytes(h, &t->nmemb, sizeof(t->nmemb));
+    h = amf3__hash_string(h, t->type);
+    int i;
+    for (i = 0; i < t->nmemb; i++)
+	h = amf3__hash_string(h, t->members[i]);
+    return (t->hash = h ? h : 1);
+}
+
+static int amf3__traits_equal(AMF3Value a, AMF3Value b) {
+    struct amf3_traits *ta = &a->v.traits, *tb = &b->v.traits;
+    if (a == b)
+	return 1;
+    if (!ta->externalizable != !tb->externalizable ||
+	    !ta->dynamic != !tb->dynamic ||
+	    ta->nmemb != tb->nmemb ||
+	    (ta->hash && tb->hash && ta->hash != tb->hash) ||
+	    !amf3__string_equal(ta->type, tb->type))
+	return 0;
+    int i;
+    for (i = 0; i < ta->nmemb; i++)
+	if (!amf3__string_equal(ta->members[i], tb->members[i]))
+	    return 0;
+    return 1;
+}
+
+/* returns 0 if values of this type are not indexed. */
+static int amf3__ref_hash(AMF3Value v, unsigned int *hash) {
+    unsigned int h = AMF3_HASH_SEED;
+    double d;
+    switch (v->type) {
+	case AMF3_STRING:
+	case AMF3_XMLDOC:
+	case AMF3_XML:
+	case AMF3_BYTEARRAY:
+	    h = amf3__hash_bytes(h, &v->type, sizeof(v->type));
+	    h = amf3__hash_bytes(h, &v->v.binary.length, sizeof(int));
+	    h = amf3__hash_bytes(h, v->v.binary.data, v->v.binary.length);
+	    break;
+
+	case AMF3_DOUBLE:
+	case AMF3_DATE:
+	    // 0.0 == -0.0, make them hash alike
+	    d = v->type == AMF3_DATE ? v->v.date.value : v->v.real;
+	    if (d == 0.0)
+		d = 0.0;
+	    h = amf3__hash_bytes(h, &v->type, sizeof(v->type));
+	    h = amf3__hash_bytes(h, &d, sizeof(d));
+	    break;
+
+	case AMF3_OBJECT:
+	case AMF3_ARRAY:
+	    // by identity
+	    h = amf3__hash_pointer(v);
+	    break;
+
+	case AMF3_TRAITS:
+	    h = amf3__traits_hash(v);
+	    break;
+
+	default:
+	    return 0;
+    }
+    *hash = h ? h : 1;
+    return 1;
+}
+
+static int amf3__ref_equal(AMF3Value a, AMF3Value b) {
+    if (a == b)
+	return 1;
+    if (a->type != b->type)
+	return 0;
+    switch (a->type) {
+	case AMF3_STRING:
+	case AMF3_XMLDOC:
+	case AMF3_XML:
+	case AMF3_BYTEARRAY:
+	    return a->v.binary.length == b->v.binary.length &&
+		memcmp(a->v.binary.data, b->v.binary.data,
+			a->v.binary.length) == 0;
+
+	case AMF3_DOUBLE:
+	    return a->v.real == b->v.real;
+
+	case AMF3_DATE:
+	    return a->v.date.value == b->v.date.value;
+
+	case AMF3_TRAITS:
+	    return amf3__traits_equal(a, b);
+
+	default:
+	    // objects and arrays only match themselves
+	    return 0;
+    }
+}
+
+static void amf3__ref_index_insert(struct amf3_ref_table *r, int idx) {
+    unsigned int mask = r->nslot - 1;
+    unsigned int i = r->hashes[idx] & mask;
+    while (r->slots[i])
+	i = (i + 1) & mask;
+    r->slots[i] = idx + 1;
+}
+
+static void amf3__ref_index_grow(struct amf3_ref_table *r) {
+    int nslot = r->nslot << 1;
+    int *slots = CALLOC(nslot, int);
+    assert(slots);
+    free(r->slots);
+    r->slots = slots;
+    r->nslot = nslot;
+    int i;
+    for (i = 0; i < r->nref; i++)
+	if (r->hashes[i])
+	    amf3__ref_index_insert(r, i);
+}
+
+static int amf3__ref_index_find(struct amf3_ref_table *r,
+	AMF3Value v, unsigned int hash) {
+    unsigned int mask = r->nslot - 1;
+    unsigned int i = hash & mask;
+    int slot;
+    while ((slot = r->slots[i]) != 0) {
+	if (r->hashes[slot - 1] == hash &&
+		amf3__ref_equal(r->refs[slot - 1], v))
+	    return slot - 1;
+	i = (i + 1) & mask;
+    }
+    return -1;
+}
+
 AMF3Value amf3_ref_table_push(struct amf3_ref_table *r, AMF3Value v) {
     assert(r);
     if (r->nref == r->nalloc) {
 	r->refs = realloc(r->refs,
 		(r->nalloc <<= 1) * sizeof(AMF3Value));
 	assert(r->refs);
+	if (r->hashes) {
+	    r->hashes = realloc(r->hashes, r->nalloc * sizeof(unsigned int));
+	    assert(r->hashes);
+	}
     }
-    return (r->refs[r->nref++] = amf3_retain(v));
+    if (r->slots) {
+	// keep the load factor of the index under 1/2
+	if ((r->nref + 1) * 2 > r->nslot)
+	    amf3__ref_index_grow(r);
+	unsigned int hash;
+	r->hashes[r->nref] = amf3__ref_hash(v, &hash) ? hash : 0;
+	if (r->hashes[r->nref])
+	    amf3__ref_index_insert(r, r->nref);
+    }
+    return (r->refs[r->nref++] = amf3__ref_retain(r, v));
 }
 
 AMF3Value amf3_ref_table_get(struct amf3_ref_table *r, int idx) {
@@ -650,7 +1599,7 @@ static void *amf3__find_traits(struct amf3_ref_table *r,
     struct amf3_valfind *vf = ctx;
     if (v->type != AMF3_TRAITS)
 	return NULL;
-    if (amf3_string_cmp(v->v.traits.type, vf->value->v.traits.type) == 0) {
+    if (amf3__traits_equal(v, vf->value)) {
 	vf->idx = idx;
 	return v;
     }
@@ -670,6 +1619,9 @@ void *amf3_ref_table_foreach(struct amf3_ref_table *r,
 
 int amf3_ref_table_find(struct amf3_ref_table *r, AMF3Value v) {
     struct amf3_valfind vf = {v, -1};
+    unsigned int hash;
+    if (r->slots && amf3__ref_hash(v, &hash))
+	return amf3__ref_index_find(r, v, hash);
     switch (v->type) {
 	case AMF3_UNDEFINED:
 	case AMF3_NULL:
@@ -713,32 +1665,268 @@ int amf3_ref_table_find(struct amf3_ref_table *r, AMF3Value v) {
     return vf.idx;
 }
 
+/* fails a read of `n' bytes past the end of input, and remembers that the
+ * input was short rather than malformed. */
+#define AMF3__NEED(c, n) ((c)->left >= (n) || ((c)->starved = 1, 0))
+
+/* Decodes a U29 from 4 readable bytes at `p' with one load and no loop:
+ * the continuation bits of the first three bytes give its length, and the
+ * 4-byte reading of the groups, shifted, gives its value.  Stores the
+ * length in `*n'. */
+static int amf3__decode_u29(const char *p, int *n) {
+    static const unsigned char lengths[8] = {1, 2, 1, 3, 1, 2, 1, 4};
+    static const unsigned char shifts[5] = {0, 22, 15, 8, 0};
+    const unsigned char *u = (const unsigned char *)p;
+    unsigned int w = ((unsigned int)u[0] << 24) | ((unsigned int)u[1] << 16) |
+	((unsigned int)u[2] << 8) | u[3];
+    unsigned int cont = ((w >> 31) & 1) | ((w >> 22) & 2) | ((w >> 13) & 4);
+    unsigned int all = ((w >> 2) & 0x1fc00000) | ((w >> 1) & 0x003f8000) |
+	(w & 0x00007fff);
+    *n = lengths[cont];
+    return all >> shifts[*n];
+}
+
 int amf3_parse_u29(struct amf3_parse_context *c) {
     int j;
     int v = 0;
     unsigned char i;
 
+    if (c->left >= 4) {
+	v = amf3__decode_u29(c->p, &j);
+	c->p += j;
+	c->left -= j;
+	return v;
+    }
+    // near the end of input, byte by byte
     for (j = 0; j < 3; j++) {
-	if (c->left < 1) return -1;
+	if (!AMF3__NEED(c, 1)) return -1;
 	i = *c->p++; c->left--;
 	v = (v << 7) | (i & 0x7F);
 	if (!(i & 0x80)) return v;
     }
 
-    if (c->left < 1) return -1;
+    if (!AMF3__NEED(c, 1)) return -1;
     i = *c->p++; c->left--;
     return (v << 8) | i;
 }
 
+static int amf3__table_reserve(void *items, int *alloc, int count,
+	size_t size, void *first);
+static const struct amf3_visitor g_visit_nothing;
+
+/* looks up a reference while parsing.  A slot defined inside a skipped
+ * subtree holds that subtree's lazy value until it is decoded. */
+static AMF3Value amf3__parse_ref(struct amf3_parse_context *c,
+	struct amf3_ref_table *r, int idx) {
+    AMF3Value v;
+    while ((v = amf3_ref_table_get(r, idx)) != NULL &&
+	    (v->flags & AMF3_VALUE_LAZY) &&
+	    !(r == c->object_refs && v->v.lazy.nobject == idx)) {
+	if (amf3__materialize(v) != 0)
+	    return NULL;
+	assert(amf3_ref_table_get(r, idx) != v);
+    }
+    if (!v) {
+	LOG(LOG_ERROR, "%s: bad reference %d\n", __func__, idx);
+	return NULL;
+    }
+    return amf3_retain(v);
+}
+
+/* where a skip that ran out of input stood in one array or object */
+struct amf3__resume_level {
+    int offset;			/* of its marker, -1 if none */
+    char state;			/* AMF3__FRAME_*, the part it was in */
+    int idx;			/* of that dense element or sealed member */
+    int at;			/* offset of the element, or of its key */
+    int nstring, nobject, ntraits;
+};
+
+/* The path to where a skip ran out of input, so that a later attempt on
+ * longer input jumps along it instead of walking everything again.  The
+ * offsets are from the start of the input, which may move in between. */
+struct amf3_visit_resume {
+    struct amf3__resume_level *levels;	/* by depth */
+    int nlevel;
+    int level_alloc;
+    int noted;			/* the current failure is recorded */
+    const char *data;		/* the input table views point into */
+    int length;
+    int nstring, ntraits;	/* table entries that earlier attempts made */
+};
+
+static void amf3__visit_resume_clear(struct amf3_visit_resume *r) {
+    r->nlevel = 0;
+    r->nstring = r->ntraits = 0;
+    r->data = NULL;
+    r->length = 0;
+}
+
+/* forgets whatever the skip pass knew of the reference tables. */
+static void amf3__shadow_clear(struct amf3_parse_context *c) {
+    struct amf3_visit_context *s = c->shadow;
+    if (!s)
+	return;
+    s->starved = 0;
+    s->nstring = s->nobject = s->ntraits = s->nname = 0;
+    if (s->resume)
+	amf3__visit_resume_clear(s->resume);
+}
+
+/* brings the skip pass up to date with the first `nobject', `nstring' and
+ * `ntraits' references parsed. */
+static int amf3__shadow_sync(struct amf3_parse_context *c,
+	int nobject, int nstring, int ntraits) {
+    struct amf3_visit_context *s = c->shadow;
+    for (; s->nstring < nstring; s->nstring++) {
+	AMF3Value v = c->string_refs->refs[s->nstring];
+	if (amf3__table_reserve(&s->strings, &s->string_alloc, s->nstring,
+		    sizeof(struct amf3_strview), s->string_inline))
+	    return -1;
+	s->strings[s->nstring].data = v->v.binary.data;
+	s->strings[s->nstring].length = v->v.binary.length;
+    }
+    for (; s->ntraits < ntraits; s->ntraits++) {
+	struct amf3_traits *t = &c->traits_refs->refs[s->ntraits]->v.traits;
+	if (amf3__table_reserve(&s->traits, &s->traits_alloc, s->ntraits,
+		    sizeof(struct amf3_visit_traits), s->traits_inline))
+	    return -1;
+	struct amf3_visit_traits *vt = &s->traits[s->ntraits];
+	vt->classname.data = t->type->v.binary.data;
+	vt->classname.length = t->type->v.binary.length;
+	vt->externalizable = t->externalizable;
+	vt->dynamic = t->dynamic;
+	vt->nmemb = t->nmemb;
+	vt->members = 0;
+    }
+    s->nobject = nobject;
+    return 0;
+}
+
+/* the same, with everything parsed so far. */
+static int amf3__lazy_sync(struct amf3_parse_context *c) {
+    return amf3__shadow_sync(c, c->object_refs->nref,
+	    c->string_refs->nref, c->traits_refs->nref);
+}
+
+/* whether the next value is an inline array or object. */
+static int amf3__lazy_skippable(struct amf3_parse_context *c) {
+    if (c->left < 2 || (*c->p != AMF3_ARRAY && *c->p != AMF3_OBJECT))
+	return 0;
+    const char *p = c->p;
+    int left = c->left, starved = c->starved;
+    c->p++;
+    c->left--;
+    int ref = amf3_parse_u29(c);
+    c->p = p;
+    c->left = left;
+    c->starved = starved;
+    return ref >= 0 && (ref & 0x1);
+}
+
+/* skips an inline array or object nested in the value being decoded; it
+ * and everything defined inside it are represented by one lazy value. */
+static AMF3Value amf3__parse_lazy(struct amf3_parse_context *c) {
+    struct amf3_visit_context *s = c->shadow;
+    if (amf3__lazy_sync(c) != 0)
+	return NULL;
+    s->p = c->p;
+    s->left = c->left;
+    s->starved = 0;
+    if (amf3_visit_skip(s) != 0) {
+	c->starved = s->starved;
+	return NULL;
+    }
+
+    AMF3Value v = amf3__new_value(c->arena, *c->p);
+    if (!v)
+	return NULL;
+    v->flags |= AMF3_VALUE_LAZY;
+    v->v.lazy.c = c;
+    v->v.lazy.offset = c->p - c->data;
+    v->v.lazy.nobject = c->object_refs->nref;
+    v->v.lazy.nstring = c->string_refs->nref;
+    v->v.lazy.ntraits = c->traits_refs->nref;
+    while (c->object_refs->nref < s->nobject)
+	amf3_ref_table_push(c->object_refs, v);
+    while (c->string_refs->nref < s->nstring)
+	amf3_ref_table_push(c->string_refs, v);
+    while (c->traits_refs->nref < s->ntraits)
+	amf3_ref_table_push(c->traits_refs, v);
+    c->p = s->p;
+    c->left = s->left;
+    return v;
+}
+
+/* when decoding a lazy value, moves the new container into it, since the
+ * tree and the reference tables already point there. */
+static AMF3Value amf3__adopt(struct amf3_parse_context *c, AMF3Value v) {
+    AMF3Value lazy = c->adopt;
+    if (!lazy)
+	return v;
+    assert(lazy->type == v->type);
+    c->adopt = NULL;
+    lazy->v = v->v;
+    lazy->flags &= ~AMF3_VALUE_LAZY;
+    return lazy;
+}
+
+static int amf3__materialize(AMF3Value v) {
+    struct amf3_lazy lazy = v->v.lazy;
+    struct amf3_parse_context *c = lazy.c;
+    struct amf3_visit_context *s = c->shadow;
+
+    // decode it as if the parse were back there, refilling the slots the
+    // skip reserved; then pick up where we were.
+    const char *p = c->p;
+    int left = c->left;
+    int nobject = c->object_refs->nref;
+    int nstring = c->string_refs->nref;
+    int ntraits = c->traits_refs->nref;
+    int sobject = s->nobject, sstring = s->nstring, straits = s->ntraits;
+    AMF3Value adopt = c->adopt;
+    int depth = c->depth;
+
+    c->p = c->data + lazy.offset;
+    c->left = c->length - lazy.offset;
+    c->object_refs->nref = s->nobject = lazy.nobject;
+    c->string_refs->nref = s->nstring = lazy.nstring;
+    c->traits_refs->nref = s->ntraits = lazy.ntraits;
+    c->adopt = v;
+    c->depth = 0;
+    AMF3Value r = amf3_parse_value(c);
+
+    c->p = p;
+    c->left = left;
+    c->object_refs->nref = nobject;
+    c->string_refs->nref = nstring;
+    c->traits_refs->nref = ntraits;
+    s->nobject = sobject;
+    s->nstring = sstring;
+    s->ntraits = straits;
+    c->adopt = adopt;
+    c->depth = depth;
+    if (r != v) {
+	LOG(LOG_ERROR, "%s: cannot decode lazy value at %d\n",
+		__func__, lazy.offset);
+	return -1;
+    }
+    return 0;
+}
+
 AMF3Value amf3_parse_string(struct amf3_parse_context *c) {
     int len = amf3_parse_u29(c);
     if (len < 0)
 	return NULL;
     if (!(len & 0x1))
-	return amf3_retain(amf3_ref_table_get(c->string_refs, len >> 1));
-    if ((len >>= 1) > c->left)
+	return amf3__parse_ref(c, c->string_refs, len >> 1);
+    if (!AMF3__NEED(c, len >>= 1))
+	return NULL;
+    AMF3Value v = (c->flags & AMF3_PARSE_BORROW)
+	? amf3__new_binary_view(c->arena, AMF3_STRING, c->p, len)
+	: amf3__new_binary(c->arena, AMF3_STRING, c->p, len);
+    if (!v)
 	return NULL;
-    AMF3Value v = amf3_new_string(c->p, len);
     c->p += len;
     c->left -= len;
     if (len > 0)
@@ -746,43 +1934,89 @@ AMF3Value amf3_parse_string(struct amf3_parse_context *c) {
     return v;
 }
 
+/* parses a class, member or key name, interned with AMF3_PARSE_INTERN. */
+static AMF3Value amf3__parse_name(struct amf3_parse_context *c) {
+    struct amf3_ref_table *r = c->string_refs;
+    int nref = r->nref;
+    AMF3Value v = amf3_parse_string(c);
+    if (!v || !(c->flags & AMF3_PARSE_INTERN) ||
+	    (v->flags & AMF3_VALUE_INTERNED))
+	return v;
+    AMF3Value s = amf3_intern_value(v);
+    if (s && (s->flags & AMF3_VALUE_INTERNED) && r->nref > nref) {
+	// let later references to the name resolve to the interned string
+	assert(!r->slots && r->refs[nref] == v);
+	r->refs[nref] = s;
+	amf3_release(v);
+    }
+    amf3_release(v);
+    return s;
+}
+
 static AMF3Value amf3__parse_binary_object(
 	struct amf3_parse_context *c, char type) {
     int len = amf3_parse_u29(c);
     if (len < 0)
 	return NULL;
     if (!(len & 0x1))
-	return amf3_retain(amf3_ref_table_get(c->object_refs, len >> 1));
-    if ((len >>= 1) > c->left)
+	return amf3__parse_ref(c, c->object_refs, len >> 1);
+    if (!AMF3__NEED(c, len >>= 1))
+	return NULL;
+    AMF3Value v = (c->flags & AMF3_PARSE_BORROW)
+	? amf3__new_binary_view(c->arena, type, c->p, len)
+	: amf3__new_binary(c->arena, type, c->p, len);
+    if (!v)
 	return NULL;
-    AMF3Value v = amf3__new_binary(type, c->p, len);
     c->p += len;
     c->left -= len;
     return amf3_ref_table_push(c->object_refs, v);
 }
 
+/* appends up to `max' consecutive integers to the dense part of `arr',
+ * decoding them in a tight loop while 4 bytes follow each marker.
+ * returns how many were appended, or -1 if out of memory. */
+static int amf3__parse_integer_run(struct amf3_parse_context *c,
+	AMF3Value arr, int max) {
+    struct amf3_array *a = &arr->v.array;
+    const char *p = c->p, *end = c->p + c->left - 4;
+    int n = 0, len;
+    while (n < max && p < end && *p == AMF3_INTEGER &&
+	    a->ndense < a->dense_alloc) {
+	int integer = amf3__decode_u29(p + 1, &len);
+	AMF3Value v = amf3__new_integer(c->arena, (integer << 3) >> 3);
+	if (!v)
+	    return -1;
+	a->dense[a->ndense++] = v;
+	p += 1 + len;
+	n++;
+    }
+    c->left -= p - c->p;
+    c->p = p;
+    return n;
+}
+
 AMF3Value amf3_parse_array(struct amf3_parse_context *c) {
     int len = amf3_parse_u29(c);
     if (len < 0)
 	return NULL;
     if (!(len & 0x1))
-	return amf3_retain(amf3_ref_table_get(c->object_refs, len >> 1));
+	return amf3__parse_ref(c, c->object_refs, len >> 1);
     len >>= 1;
     LOG(LOG_DEBUG, "[ARRAY] length = %d\n", len);
 
-    AMF3Value arr = amf3_new_array();
+    AMF3Value arr = amf3__new_array(c->arena);
     if (!arr)
 	return NULL;
+    arr = amf3__adopt(c, arr);
     amf3_ref_table_push(c->object_refs, arr);
 
     LOG(LOG_DEBUG, "[ARRAY] parsing assoc part\n");
     AMF3Value key;
-    while ((key = amf3_parse_string(c)) != NULL &&
+    while ((key = amf3__parse_name(c)) != NULL &&
 	    amf3_string_len(key) > 0) {
 	AMF3Value value = amf3_parse_value(c);
 	if (!value) {
 	    amf3_release(key);
-	    amf3_release(value);
 	    amf3_release(arr);
 	    return NULL;
 	}
@@ -793,8 +2027,23 @@ AMF3Value amf3_parse_array(struct amf3_parse_context *c) {
     if (key)
 	amf3_release(key);
 
+    // every element takes at least one byte, which bounds the preallocation
+    // a corrupted length can cause.
+    if (amf3__array_reserve(arr, len < c->left ? len : c->left)) {
+	amf3_release(arr);
+	return NULL;
+    }
     int i;
     for (i = 0; i < len; i++) {
+	if (c->left >= 5 && *c->p == AMF3_INTEGER) {
+	    int n = amf3__parse_integer_run(c, arr, len - i);
+	    if (n < 0) {
+		amf3_release(arr);
+		return NULL;
+	    }
+	    if ((i += n) == len)
+		break;
+	}
 	LOG(LOG_DEBUG, "[ARRAY] parsing dense part #%d of %d\n", i, len);
 	AMF3Value elem = amf3_parse_value(c);
 	if (!elem) {
@@ -808,246 +2057,2065 @@ AMF3Value amf3_parse_array(struct amf3_parse_context *c) {
     return arr;
 }
 
+/* parses the traits part of an object header `ref' (an inline object). */
+static AMF3Value amf3__parse_traits(struct amf3_parse_context *c, int ref) {
+    if ((ref & 0x3) == 0x1) {
+	AMF3Value traits = amf3__parse_ref(c, c->traits_refs, ref >> 2);
+	if (traits)
+	    LOG(LOG_DEBUG, "[*TRAITS]{%d} %.*s\n", ref >> 2,
+		    STRARG(traits->v.traits.type));
+	return traits;
+    }
+
+    char external = ((ref & 0x7) == 0x7) ? 1 : 0;
+    char dynamic = 0;
+    int nmemb = 0;
+    if (!external) {
+	dynamic = (ref >> 3) & 1;
+	nmemb = ref >> 4;
+    }
+
+    AMF3Value classname = amf3__parse_name(c);
+    if (!classname)
+	return NULL;
+    AMF3Value traits = amf3__new_traits(c->arena, classname,
+	    external, dynamic, nmemb);
+    amf3_release(classname);
+    if (!traits)
+	return NULL;
+
+    int i;
+    for (i = 0; i < nmemb; i++) {
+	AMF3Value key = amf3__parse_name(c);
+	if (!key) {
+	    amf3_release(traits);
+	    return NULL;
+	}
+	amf3__traits_member_set(traits, i, key);
+	amf3_release(key);
+    }
+
+    amf3_ref_table_push(c->traits_refs, traits);
+
+    LOG(LOG_DEBUG, "[TRAITS]{%d}[%s%s] %.*s\n",
+	    c->traits_refs->nref - 1,
+	    external ? "E" : " ",
+	    dynamic ? "D" : " ",
+	    STRARG(traits->v.traits.type));
+    return traits;
+}
+
+/* creates the object for `traits' and registers it as a reference;
+ * externalizable objects are parsed completely by their plugin. */
+static AMF3Value amf3__parse_object_start(
+	struct amf3_parse_context *c, AMF3Value traits) {
+    AMF3Value classname = traits->v.traits.type;
+    AMF3Value obj;
+    if (!traits->v.traits.externalizable) {
+	obj = amf3__new_object_direct(c->arena, traits, NULL);
+	if (obj) {
+	    obj = amf3__adopt(c, obj);
+	    amf3_ref_table_push(c->object_refs, obj);
+	}
+	return obj;
+    }
+
+    obj = amf3__new_object_external_direct(c->arena, traits, NULL);
+    if (!obj)
+	return NULL;
+    obj = amf3__adopt(c, obj);
+    amf3_ref_table_push(c->object_refs, obj);
+
+    const struct amf3_plugin_parser *pp;
+    if ((pp = amf3__traits_plugin(traits)) == NULL) {
+	LOG(LOG_ERROR, "%s: cannot parse type '%.*s'\n",
+		__func__, STRARG(classname));
+	amf3_release(obj);
+	return NULL;
+    }
+    int starved = c->starved;
+    c->starved = 0;
+    int r = pp->handler(c, classname, &obj->v.object.m.external_ctx);
+    // plugins need not check every read they make, so catch short input
+    // here rather than keep a partially parsed object.
+    if (r != 0 || c->starved) {
+	if (!c->starved)
+	    LOG(LOG_ERROR, "%s: external parser of type '%.*s' returns error\n",
+		    __func__, STRARG(classname));
+	if (c->arena) {
+	    amf3__free_external_cb(obj);
+	    obj->v.object.m.external_ctx = NULL;
+	}
+	amf3_release(obj);
+	return NULL;
+    }
+    c->starved = starved;
+    // the arena never calls `amf3__free_value', so hand the
+    // external context over to it explicitly.
+    if (c->arena)
+	arena_add_cleanup(c->arena, amf3__free_external_cb, obj);
+    return obj;
+}
+
 AMF3Value amf3_parse_object(struct amf3_parse_context *c) {
     int ref = amf3_parse_u29(c);
     if (ref < 0)
 	return NULL;
     if (!(ref & 0x1))
-	return amf3_retain(amf3_ref_table_get(c->object_refs, ref >> 1));
+	return amf3__parse_ref(c, c->object_refs, ref >> 1);
 
-    AMF3Value traits;
-    AMF3Value classname;
-    char external = ((ref & 0x7) == 0x7) ? 1 : 0;
-    char dynamic = 0;
-    int nmemb = 0;
-    if ((ref & 0x3) == 0x1) {
-	// traits ref
-	traits = amf3_retain(amf3_ref_table_get(c->traits_refs, ref >> 2));
-	classname = amf3_retain(traits->v.traits.type);
-	external = traits->v.traits.externalizable;
-	dynamic = traits->v.traits.dynamic;
-	nmemb = traits->v.traits.nmemb;
-
-	LOG(LOG_DEBUG, "[*TRAITS]{%d} %s\n", ref >> 2,
-		amf3_string_cstr(classname));
-    } else {
-	classname = amf3_parse_string(c);
-	if (!classname)
+    AMF3Value traits = amf3__parse_traits(c, ref);
+    if (!traits)
+	return NULL;
+    // the object keeps its traits alive from here on
+    AMF3Value obj = amf3__parse_object_start(c, traits);
+    amf3_release(traits);
+    if (!obj || obj->v.object.traits->v.traits.externalizable)
+	return obj;
+
+    int i, nmemb = traits->v.traits.nmemb;
+    for (i = 0; i < nmemb; i++) {
+	LOG(LOG_DEBUG, "%.*s::%.*s\n",
+		STRARG(traits->v.traits.type),
+		STRARG(traits->v.traits.members[i]));
+
+	AMF3Value value = amf3_parse_value(c);
+	if (!value) {
+	    amf3_release(obj);
+	    return NULL;
+	}
+	obj->v.object.m.i.member_values[i] = value;
+
+#if DEBUG_LEVEL >= LOG_DEBUG
+	if (value->type != AMF3_OBJECT && value->type != AMF3_ARRAY) {
+	    LOG(LOG_DEBUG, "=> ");
+	    amf3_dump_value(value, 0);
+	}
+#endif
+    }
+
+    if (traits->v.traits.dynamic) {
+	AMF3Value key;
+	while ((key = amf3__parse_name(c)) != NULL &&
+		amf3_string_len(key) > 0) {
+	    AMF3Value value = amf3_parse_value(c);
+	    if (!value) {
+		amf3_release(obj);
+		amf3_release(key);
+		return NULL;
+	    }
+	    amf3_object_prop_set(obj, key, value);
+	    amf3_release(key);
+	    amf3_release(value);
+	}
+	if (!key) {
+	    amf3_release(obj);
 	    return NULL;
+	}
+	amf3_release(key);
+    }
+    return obj;
+}
+
+static double amf3__decode_double(const char *p) {
+    union {
+	uint64_t i;
+	double d;
+    } conv;
+    conv.i = NTOH64(*((uint64_t *)p));
+    return conv.d;
+}
+
+static int amf3__read_double(struct amf3_parse_context *c, double *d) {
+    if (!AMF3__NEED(c, (int)sizeof(uint64_t)))
+	return -1;
+    *d = amf3__decode_double(c->p);
+    c->p += sizeof(uint64_t);
+    c->left -= sizeof(uint64_t);
+    return 0;
+}
+
+AMF3Value amf3_parse_date(struct amf3_parse_context *c) {
+    int ref = amf3_parse_u29(c);
+    if (ref < 0)
+	return NULL;
+    if (!(ref & 0x1))
+	return amf3__parse_ref(c, c->object_refs, ref >> 1);
+    double date;
+    if (amf3__read_double(c, &date) != 0)
+	return NULL;
+    AMF3Value v = amf3__new_date(c->arena, date);
+    if (!v)
+	return NULL;
+    return amf3_ref_table_push(c->object_refs, v);
+}
+
+static int amf3__depth_exceeded(const char *func, int depth) {
+    if (depth < AMF3_MAX_DEPTH)
+	return 0;
+    LOG(LOG_ERROR, "%s: nested more than %d deep\n", func, AMF3_MAX_DEPTH);
+    return 1;
+}
+
+AMF3Value amf3_parse_value(struct amf3_parse_context *c) {
+    if (c->depth > 0 && (c->flags & AMF3_PARSE_LAZY) &&
+	    amf3__lazy_skippable(c))
+	return amf3__parse_lazy(c);
+    if (!AMF3__NEED(c, 1))
+	return NULL;
+    char mark = *c->p++;
+    c->left--;
+    AMF3Value v;
+    switch (mark) {
+	case AMF3_UNDEFINED:
+	case AMF3_NULL:
+	case AMF3_FALSE:
+	case AMF3_TRUE:
+	    return amf3__new_value(c->arena, mark);
+
+	case AMF3_INTEGER:
+	    {
+		int integer = amf3_parse_u29(c);
+		if (integer < 0)
+		    return NULL;
+		return amf3__new_integer(c->arena, (integer << 3) >> 3);
+	    }
+
+	case AMF3_DOUBLE:
+	    {
+		double real;
+		if (amf3__read_double(c, &real) != 0)
+		    return NULL;
+		return amf3__new_double(c->arena, real);
+	    }
+
+	case AMF3_STRING:
+	    return amf3_parse_string(c);
+
+	case AMF3_XMLDOC:
+	case AMF3_XML:
+	case AMF3_BYTEARRAY:
+	    return amf3__parse_binary_object(c, mark);
+
+	case AMF3_DATE:
+	    return amf3_parse_date(c);
+
+	case AMF3_ARRAY:
+	    if (amf3__depth_exceeded(__func__, c->depth))
+		return NULL;
+	    c->depth++;
+	    v = amf3_parse_array(c);
+	    c->depth--;
+	    return v;
+
+	case AMF3_OBJECT:
+	    if (amf3__depth_exceeded(__func__, c->depth))
+		return NULL;
+	    c->depth++;
+	    v = amf3_parse_object(c);
+	    c->depth--;
+	    return v;
+
+	default:
+	    LOG(LOG_ERROR, "%s: unknown type %02X\n", __func__, mark);
+	    return NULL;
+    }
+}
+
+AMF3ParseContext amf3_parse_context_new(const char *data, int length) {
+    return amf3_parse_context_new_ex(data, length, 0);
+}
+
+AMF3ParseContext amf3_parse_context_new_ex(const char *data, int length,
+	int flags) {
+    AMF3ParseContext c = CALLOC(1, struct amf3_parse_context);
+    if (c) {
+	c->data = c->p = data;
+	c->length = c->left = length;
+	if (flags & AMF3_PARSE_LAZY)
+	    flags |= AMF3_PARSE_ARENA | AMF3_PARSE_BORROW;
+	c->flags = flags;
+	c->object_refs = amf3_ref_table_new();
+	c->string_refs = amf3_ref_table_new();
+	c->traits_refs = amf3_ref_table_new();
+	if (flags & AMF3_PARSE_ARENA)
+	    c->arena = arena_new(0);
+	if (flags & AMF3_PARSE_LAZY)
+	    c->shadow = amf3_visit_context_new(data, length,
+		    &g_visit_nothing, NULL);
+	if (!c->object_refs || !c->string_refs || !c->traits_refs ||
+		((flags & AMF3_PARSE_ARENA) && !c->arena) ||
+		((flags & AMF3_PARSE_LAZY) && !c->shadow)) {
+	    amf3_parse_context_free(c);
+	    return NULL;
+	}
+    }
+    return c;
+}
+
+void amf3_parse_context_free(AMF3ParseContext c) {
+    assert(c);
+    if (c->object_refs)
+	amf3_ref_table_free(c->object_refs);
+    if (c->string_refs)
+	amf3_ref_table_free(c->string_refs);
+    if (c->traits_refs)
+	amf3_ref_table_free(c->traits_refs);
+    if (c->arena)
+	arena_free(c->arena);
+    if (c->shadow)
+	amf3_visit_context_free(c->shadow);
+    free(c);
+}
+
+Arena amf3_parse_context_detach_arena(AMF3ParseContext c) {
+    assert(!(c->flags & AMF3_PARSE_LAZY));
+    Arena arena = c->arena;
+    // the reference tables point into the arena
+    amf3_ref_table_reset(c->object_refs);
+    amf3_ref_table_reset(c->string_refs);
+    amf3_ref_table_reset(c->traits_refs);
+    amf3__shadow_clear(c);
+    c->arena = NULL;
+    c->flags &= ~AMF3_PARSE_ARENA;
+    return arena;
+}
+
+void amf3_parse_context_reset(AMF3ParseContext c, const char *data, int length) {
+    c->data = c->p = data;
+    c->length = c->left = length;
+    c->starved = 0;
+    c->depth = 0;
+    c->adopt = NULL;
+    // values go before the arena that holds them
+    amf3_ref_table_reset(c->object_refs);
+    amf3_ref_table_reset(c->string_refs);
+    amf3_ref_table_reset(c->traits_refs);
+    if (c->arena)
+	arena_reset(c->arena);
+    amf3__shadow_clear(c);
+    if (c->shadow) {
+	c->shadow->data = c->shadow->p = data;
+	c->shadow->length = c->shadow->left = length;
+    }
+}
+
+/* released contexts of the calling thread */
+struct amf3_context_pool {
+    AMF3ParseContext parse[AMF3_CONTEXT_POOL_SIZE];
+    int nparse;
+    AMF3SerializeContext serialize[AMF3_CONTEXT_POOL_SIZE];
+    int nserialize;
+};
+
+static pthread_key_t g_pool_key;
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+static int g_pool_ready;
+
+static void amf3__pool_free(void *P) {
+    struct amf3_context_pool *pool = (struct amf3_context_pool *)P;
+    int i;
+    for (i = 0; i < pool->nparse; i++)
+	amf3_parse_context_free(pool->parse[i]);
+    for (i = 0; i < pool->nserialize; i++)
+	amf3_serialize_context_free(pool->serialize[i]);
+    free(pool);
+}
+
+static void amf3__pool_init() {
+    g_pool_ready = pthread_key_create(&g_pool_key, amf3__pool_free) == 0;
+}
+
+static struct amf3_context_pool *amf3__pool_get(int create) {
+    pthread_once(&g_pool_once, amf3__pool_init);
+    if (!g_pool_ready)
+	return NULL;
+    struct amf3_context_pool *pool = pthread_getspecific(g_pool_key);
+    if (!pool && create) {
+	pool = CALLOC(1, struct amf3_context_pool);
+	if (pool && pthread_setspecific(g_pool_key, pool) != 0) {
+	    free(pool);
+	    pool = NULL;
+	}
+    }
+    return pool;
+}
+
+AMF3ParseContext amf3_parse_context_acquire(const char *data, int length,
+	int flags) {
+    if (flags & AMF3_PARSE_LAZY)
+	flags |= AMF3_PARSE_ARENA | AMF3_PARSE_BORROW;
+    struct amf3_context_pool *pool = amf3__pool_get(0);
+    int i;
+    for (i = pool ? pool->nparse - 1 : -1; i >= 0; i--) {
+	AMF3ParseContext c = pool->parse[i];
+	if (c->flags == flags) {
+	    pool->parse[i] = pool->parse[--pool->nparse];
+	    amf3_parse_context_reset(c, data, length);
+	    return c;
+	}
+    }
+    return amf3_parse_context_new_ex(data, length, flags);
+}
+
+void amf3_parse_context_release(AMF3ParseContext c) {
+    struct amf3_context_pool *pool = amf3__pool_get(1);
+    if (!pool || pool->nparse == AMF3_CONTEXT_POOL_SIZE) {
+	amf3_parse_context_free(c);
+	return;
+    }
+    amf3_parse_context_reset(c, NULL, 0);
+    pool->parse[pool->nparse++] = c;
+}
+
+AMF3SerializeContext amf3_serialize_context_acquire() {
+    struct amf3_context_pool *pool = amf3__pool_get(0);
+    if (pool && pool->nserialize > 0)
+	return pool->serialize[--pool->nserialize];
+    return amf3_serialize_context_new();
+}
+
+void amf3_serialize_context_release(AMF3SerializeContext c) {
+    struct amf3_context_pool *pool = amf3__pool_get(1);
+    // only plain contexts are interchangeable
+    if (!pool || pool->nserialize == AMF3_CONTEXT_POOL_SIZE || c->flags ||
+	    c->allocated > AMF3_CONTEXT_POOL_MAX_BUFFER) {
+	amf3_serialize_context_free(c);
+	return;
+    }
+    amf3_serialize_context_reset(c);
+    pool->serialize[pool->nserialize++] = c;
+}
+
+void amf3_context_pool_clear() {
+    struct amf3_context_pool *pool = amf3__pool_get(0);
+    if (pool) {
+	pthread_setspecific(g_pool_key, NULL);
+	amf3__pool_free(pool);
+    }
+}
+
+/* items of a job not claimed yet by one worker */
+struct amf3__job_range {
+    pthread_mutex_t lock;
+    int begin;
+    int end;
+};
+
+/* a batch queued on a worker pool, embedded first in the batch itself.
+ * `finish' is called once, by the worker completing the last item. */
+struct amf3__job {
+    struct amf3__job *next;
+    void (*run)(struct amf3__job *job, int idx);
+    void (*finish)(struct amf3__job *job);
+    int remaining;		/* items not done yet, atomic */
+    int users;			/* workers on the job, under the pool lock */
+    int queued;
+    int nrange;
+    struct amf3__job_range *ranges;	/* one per worker */
+};
+
+struct amf3__worker {
+    struct amf3_worker_pool *pool;
+    int index;
+    pthread_t thread;
+};
+
+struct amf3_worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct amf3__job *head, *tail;
+    int stop;
+    int nthread;
+    struct amf3__worker *workers;
+};
+
+/* for the callers waiting on a batch */
+struct amf3__batch_wait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+};
+
+/* deals the `n' items of `job' out evenly. returns 0 if success. */
+static int amf3__job_init(struct amf3__job *job, int n, int nrange) {
+    job->ranges = CALLOC(nrange, struct amf3__job_range);
+    if (!job->ranges)
+	return -1;
+    job->nrange = nrange;
+    job->remaining = n;
+    int i;
+    for (i = 0; i < nrange; i++) {
+	pthread_mutex_init(&job->ranges[i].lock, NULL);
+	job->ranges[i].begin = (int)((int64_t)n * i / nrange);
+	job->ranges[i].end = (int)((int64_t)n * (i + 1) / nrange);
+    }
+    return 0;
+}
+
+static void amf3__job_free(struct amf3__job *job) {
+    int i;
+    for (i = 0; i < job->nrange; i++)
+	pthread_mutex_destroy(&job->ranges[i].lock);
+    free(job->ranges);
+    free(job);
+}
+
+/* returns the next item for worker `self', stolen if it has none left, or
+ * -1 once every item is claimed. */
+static int amf3__job_claim(struct amf3__job *job, int self) {
+    struct amf3__job_range *own = &job->ranges[self];
+    int idx = -1;
+    pthread_mutex_lock(&own->lock);
+    if (own->begin < own->end)
+	idx = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (idx >= 0)
+	return idx;
+
+    int i;
+    for (i = 1; i < job->nrange; i++) {
+	struct amf3__job_range *r = &job->ranges[(self + i) % job->nrange];
+	pthread_mutex_lock(&r->lock);
+	int take = (r->end - r->begin + 1) / 2;
+	int end = r->end;
+	r->end -= take;
+	pthread_mutex_unlock(&r->lock);
+	if (take > 0) {
+	    // keep the first of the stolen items, leave the rest stealable
+	    pthread_mutex_lock(&own->lock);
+	    own->begin = end - take + 1;
+	    own->end = end;
+	    pthread_mutex_unlock(&own->lock);
+	    return end - take;
+	}
+    }
+    return -1;
+}
+
+static void *amf3__worker_main(void *W) {
+    struct amf3__worker *w = (struct amf3__worker *)W;
+    struct amf3_worker_pool *pool = w->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+	while (!pool->head && !pool->stop)
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	struct amf3__job *job = pool->head;
+	if (!job)
+	    break;
+	job->users++;
+	pthread_mutex_unlock(&pool->lock);
+
+	int idx;
+	while ((idx = amf3__job_claim(job, w->index)) >= 0) {
+	    job->run(job, idx);
+	    if (!__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL))
+		job->finish(job);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	// every item is claimed, so no other worker need pick the job up
+	if (job->queued) {
+	    assert(pool->head == job);
+	    if (!(pool->head = job->next))
+		pool->tail = NULL;
+	    job->queued = 0;
+	}
+	if (!--job->users)
+	    amf3__job_free(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void amf3__worker_pool_submit(struct amf3_worker_pool *pool,
+	struct amf3__job *job) {
+    if (!job->remaining) {
+	job->finish(job);
+	amf3__job_free(job);
+	return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    job->next = NULL;
+    job->queued = 1;
+    if (pool->tail)
+	pool->tail->next = job;
+    else
+	pool->head = job;
+    pool->tail = job;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+AMF3WorkerPool amf3_worker_pool_new(int nthread) {
+    if (nthread <= 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthread = ncpu > 0 ? (int)ncpu : 1;
+    }
+    struct amf3_worker_pool *pool = CALLOC(1, struct amf3_worker_pool);
+    if (!pool)
+	return NULL;
+    pool->workers = CALLOC(nthread, struct amf3__worker);
+    if (!pool->workers) {
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    int i;
+    for (i = 0; i < nthread; i++) {
+	pool->workers[i].pool = pool;
+	pool->workers[i].index = i;
+	if (pthread_create(&pool->workers[i].thread, NULL,
+		    amf3__worker_main, &pool->workers[i]) != 0)
+	    break;
+    }
+    pool->nthread = i;
+    if (i < nthread) {
+	LOG(LOG_ERROR, "%s: cannot start worker %d\n", __func__, i);
+	amf3_worker_pool_free(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+void amf3_worker_pool_free(AMF3WorkerPool pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    int i;
+    for (i = 0; i < pool->nthread; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool);
+}
+
+static void amf3__batch_wait_init(struct amf3__batch_wait *w) {
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->done = 0;
+}
+
+static void amf3__batch_wake(struct amf3__batch_wait *w) {
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void amf3__batch_wait(struct amf3__batch_wait *w) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->done)
+	pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+struct amf3__parse_batch {
+    struct amf3__job job;
+    struct amf3_parse_item *items;
+    int n;
+    int flags;
+    int nfailed;		/* atomic */
+    AMF3ParseBatchDoneFunc done;
+    void *ctx;
+};
+
+/* tells why `data' did not parse, walking it again without building. */
+static int amf3__parse_error(const char *data, int length) {
+    int r = amf3_skip_value(data, length);
+    if (r == 0)
+	return AMF3_ITEM_TRUNCATED;
+    return r < 0 ? AMF3_ITEM_MALFORMED : AMF3_ITEM_FAILED;
+}
+
+static void amf3__parse_batch_run(struct amf3__job *job, int idx) {
+    struct amf3__parse_batch *b = (struct amf3__parse_batch *)job;
+    struct amf3_parse_item *item = &b->items[idx];
+    AMF3ParseContext c = amf3_parse_context_acquire(item->data, item->length,
+	    b->flags);
+    item->value = NULL;
+    item->error = AMF3_ITEM_NOMEM;
+    if (c) {
+	item->value = amf3_parse_value(c);
+	amf3_parse_context_release(c);
+	item->error = item->value ? AMF3_ITEM_OK
+	    : amf3__parse_error(item->data, item->length);
+    }
+    if (!item->value)
+	__atomic_fetch_add(&b->nfailed, 1, __ATOMIC_RELAXED);
+}
+
+static void amf3__parse_batch_finish(struct amf3__job *job) {
+    struct amf3__parse_batch *b = (struct amf3__parse_batch *)job;
+    b->done(b->items, b->n, __atomic_load_n(&b->nfailed, __ATOMIC_RELAXED),
+	    b->ctx);
+}
+
+static void amf3__parse_batch_wake(struct amf3_parse_item *items, int n,
+	int nfailed, void *ctx) {
+    (void)items;
+    (void)n;
+    (void)nfailed;
+    amf3__batch_wake((struct amf3__batch_wait *)ctx);
+}
+
+int amf3_parse_batch(AMF3WorkerPool pool, struct amf3_parse_item *items,
+	int n, int flags, AMF3ParseBatchDoneFunc done, void *ctx) {
+    assert(pool && n >= 0);
+    if (flags & (AMF3_PARSE_ARENA | AMF3_PARSE_LAZY)) {
+	LOG(LOG_ERROR, "%s: arena values cannot outlive the workers' contexts\n",
+		__func__);
+	return -1;
+    }
+    struct amf3__parse_batch *b = CALLOC(1, struct amf3__parse_batch);
+    if (!b)
+	return -1;
+    if (amf3__job_init(&b->job, n, pool->nthread)) {
+	free(b);
+	return -1;
+    }
+    struct amf3__batch_wait wait;
+    b->job.run = amf3__parse_batch_run;
+    b->job.finish = amf3__parse_batch_finish;
+    b->items = items;
+    b->n = n;
+    b->flags = flags;
+    b->done = done;
+    b->ctx = ctx;
+    if (!done) {
+	amf3__batch_wait_init(&wait);
+	b->done = amf3__parse_batch_wake;
+	b->ctx = &wait;
+    }
+    amf3__worker_pool_submit(pool, &b->job);
+    if (!done)
+	amf3__batch_wait(&wait);
+    return 0;
+}
+
+struct amf3__serialize_batch {
+    struct amf3__job job;
+    struct amf3_serialize_item *items;
+    int n;
+    int nfailed;		/* atomic */
+    AMF3SerializeBatchDoneFunc done;
+    void *ctx;
+};
+
+static void amf3__serialize_batch_run(struct amf3__job *job, int idx) {
+    struct amf3__serialize_batch *b = (struct amf3__serialize_batch *)job;
+    struct amf3_serialize_item *item = &b->items[idx];
+    AMF3SerializeContext c = amf3_serialize_context_acquire();
+    item->data = NULL;
+    item->length = 0;
+    item->error = AMF3_ITEM_NOMEM;
+    if (c) {
+	int len;
+	const char *out = NULL;
+	if (amf3_serialize_value(c, item->value) >= 0)
+	    out = amf3_serialize_context_get_buffer(c, &len);
+	// the context goes back to this worker's pool, keep a copy
+	if (!out)
+	    item->error = AMF3_ITEM_FAILED;
+	else if ((item->data = ALLOC(char, len > 0 ? len : 1))) {
+	    memcpy(item->data, out, len);
+	    item->length = len;
+	    item->error = AMF3_ITEM_OK;
+	}
+	amf3_serialize_context_release(c);
+    }
+    if (!item->data)
+	__atomic_fetch_add(&b->nfailed, 1, __ATOMIC_RELAXED);
+}
+
+static void amf3__serialize_batch_finish(struct amf3__job *job) {
+    struct amf3__serialize_batch *b = (struct amf3__serialize_batch *)job;
+    b->done(b->items, b->n, __atomic_load_n(&b->nfailed, __ATOMIC_RELAXED),
+	    b->ctx);
+}
+
+static void amf3__serialize_batch_wake(struct amf3_serialize_item *items,
+	int n, int nfailed, void *ctx) {
+    (void)items;
+    (void)n;
+    (void)nfailed;
+    amf3__batch_wake((struct amf3__batch_wait *)ctx);
+}
+
+int amf3_serialize_batch(AMF3WorkerPool pool,
+	struct amf3_serialize_item *items, int n,
+	AMF3SerializeBatchDoneFunc done, void *ctx) {
+    assert(pool && n >= 0);
+    struct amf3__serialize_batch *b = CALLOC(1, struct amf3__serialize_batch);
+    if (!b)
+	return -1;
+    if (amf3__job_init(&b->job, n, pool->nthread)) {
+	free(b);
+	return -1;
+    }
+    struct amf3__batch_wait wait;
+    b->job.run = amf3__serialize_batch_run;
+    b->job.finish = amf3__serialize_batch_finish;
+    b->items = items;
+    b->n = n;
+    b->done = done;
+    b->ctx = ctx;
+    if (!done) {
+	amf3__batch_wait_init(&wait);
+	b->done = amf3__serialize_batch_wake;
+	b->ctx = &wait;
+    }
+    amf3__worker_pool_submit(pool, &b->job);
+    if (!done)
+	amf3__batch_wait(&wait);
+    return 0;
+}
+
+/* one pass of `amf3_serialize_batch_concat' */
+struct amf3__concat_batch {
+    struct amf3__job job;
+    AMF3Value *values;
+    int *offsets;		/* measured lengths, then offsets */
+    char *buffer;		/* NULL while measuring */
+    int *nfailed;		/* atomic */
+    struct amf3__batch_wait *wait;
+};
+
+/* serializes `v' with a pooled context into the `size' bytes at `buffer',
+ * or only measures it if NULL. returns the length, or -1 if it failed. */
+static int amf3__serialize_pooled(AMF3Value v, char *buffer, int size) {
+    AMF3SerializeContext c = amf3_serialize_context_acquire();
+    if (!c)
+	return -1;
+    // lend the context the caller's buffer, then give its own back
+    char *own = c->buffer;
+    int allocated = c->allocated;
+    c->flags = buffer ? AMF3_SERIALIZE_FIXED : AMF3_SERIALIZE_MEASURE;
+    c->buffer = buffer;
+    c->allocated = size;
+    int length = -1;
+    if (amf3_serialize_value(c, v) >= 0 && !c->failed)
+	length = c->length;
+    c->flags = 0;
+    c->buffer = own;
+    c->allocated = allocated;
+    amf3_serialize_context_release(c);
+    return length;
+}
+
+static void amf3__concat_batch_run(struct amf3__job *job, int idx) {
+    struct amf3__concat_batch *b = (struct amf3__concat_batch *)job;
+    int length;
+    if (!b->buffer) {
+	length = amf3__serialize_pooled(b->values[idx], NULL, 0);
+	b->offsets[idx + 1] = length;
+    } else {
+	int size = b->offsets[idx + 1] - b->offsets[idx];
+	length = amf3__serialize_pooled(b->values[idx],
+		b->buffer + b->offsets[idx], size);
+	if (length != size)
+	    length = -1;
+    }
+    if (length < 0) {
+	LOG(LOG_ERROR, "%s: value %d cannot be serialized\n", __func__, idx);
+	__atomic_fetch_add(b->nfailed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void amf3__concat_batch_finish(struct amf3__job *job) {
+    amf3__batch_wake(((struct amf3__concat_batch *)job)->wait);
+}
+
+/* measures the `n' values into `offsets[1..n]' while `buffer' is NULL,
+ * else writes them at the offsets. returns how many failed, or -1 if the
+ * pass could not be started. */
+static int amf3__concat_pass(AMF3WorkerPool pool, AMF3Value *values, int n,
+	int *offsets, char *buffer) {
+    struct amf3__concat_batch *b = CALLOC(1, struct amf3__concat_batch);
+    if (!b)
+	return -1;
+    if (amf3__job_init(&b->job, n, pool->nthread)) {
+	free(b);
+	return -1;
+    }
+    struct amf3__batch_wait wait;
+    int nfailed = 0;
+    b->job.run = amf3__concat_batch_run;
+    b->job.finish = amf3__concat_batch_finish;
+    b->values = values;
+    b->offsets = offsets;
+    b->buffer = buffer;
+    b->nfailed = &nfailed;
+    b->wait = &wait;
+    amf3__batch_wait_init(&wait);
+    amf3__worker_pool_submit(pool, &b->job);
+    amf3__batch_wait(&wait);
+    return __atomic_load_n(&nfailed, __ATOMIC_RELAXED);
+}
+
+char *amf3_serialize_batch_concat(AMF3WorkerPool pool, AMF3Value *values,
+	int n, int **offsets, int *length) {
+    assert(pool && n >= 0);
+    int *offs = ALLOC(int, n + 1);
+    if (!offs)
+	return NULL;
+    char *buffer = NULL;
+    offs[0] = 0;
+    if (amf3__concat_pass(pool, values, n, offs, NULL) == 0) {
+	int64_t total = 0;
+	int i;
+	for (i = 1; i <= n && total + offs[i] <= INT32_MAX; i++)
+	    offs[i] = total += offs[i];
+	if (i <= n)
+	    LOG(LOG_ERROR, "%s: output too long\n", __func__);
+	else if ((buffer = ALLOC(char, total > 0 ? total : 1)) &&
+		amf3__concat_pass(pool, values, n, offs, buffer) != 0) {
+	    free(buffer);
+	    buffer = NULL;
+	}
+    }
+    if (!buffer) {
+	free(offs);
+	return NULL;
+    }
+    *offsets = offs;
+    *length = offs[n];
+    return buffer;
+}
+
+/* push parser frame states */
+#define AMF3__FRAME_ASSOC   (0)
+#define AMF3__FRAME_DENSE   (1)
+#define AMF3__FRAME_SEALED  (2)
+#define AMF3__FRAME_DYNAMIC (3)
+
+/* push parser step results */
+#define AMF3__STEP_ERROR    (-1)
+#define AMF3__STEP_MORE	    (0)
+#define AMF3__STEP_VALUE    (1)
+#define AMF3__STEP_FRAME    (2)
+
+struct amf3__checkpoint {
+    const char *p;
+    int left;
+    int nobject, nstring, ntraits;
+    struct arena_mark mark;	/* if parsing into an arena */
+};
+
+static void amf3__ref_table_truncate(struct amf3_ref_table *r, int nref) {
+    assert(!r->slots && nref <= r->nref);
+    while (r->nref > nref)
+	amf3__ref_release(r, r->refs[--r->nref]);
+}
+
+static void amf3__checkpoint_save(struct amf3_parse_context *c,
+	struct amf3__checkpoint *cp) {
+    cp->p = c->p;
+    cp->left = c->left;
+    cp->nobject = c->object_refs->nref;
+    cp->nstring = c->string_refs->nref;
+    cp->ntraits = c->traits_refs->nref;
+    if (c->arena)
+	arena_save(c->arena, &cp->mark);
+}
+
+/* undoes a step cut short by the end of input, so it can be retried. */
+static int amf3__checkpoint_fail(struct amf3_parse_context *c,
+	struct amf3__checkpoint *cp) {
+    if (!c->starved)
+	return AMF3__STEP_ERROR;
+    amf3__ref_table_truncate(c->object_refs, cp->nobject);
+    amf3__ref_table_truncate(c->string_refs, cp->nstring);
+    amf3__ref_table_truncate(c->traits_refs, cp->ntraits);
+    // nothing made since is referenced anymore
+    if (c->arena)
+	arena_rollback(c->arena, &cp->mark);
+    if (c->shadow) {
+	struct amf3_visit_context *s = c->shadow;
+	if (s->nobject > cp->nobject)
+	    s->nobject = cp->nobject;
+	if (s->nstring > cp->nstring)
+	    s->nstring = cp->nstring;
+	if (s->ntraits > cp->ntraits)
+	    s->ntraits = cp->ntraits;
+    }
+    c->p = cp->p;
+    c->left = cp->left;
+    c->starved = 0;
+    return AMF3__STEP_MORE;
+}
+
+AMF3PushParser amf3_push_parser_new(int flags) {
+    AMF3PushParser p = CALLOC(1, struct amf3_push_parser);
+    if (!p)
+	return NULL;
+    p->c = amf3_parse_context_new_ex(NULL, 0,
+	    flags & ~(AMF3_PARSE_BORROW | AMF3_PARSE_LAZY));
+    if (!p->c) {
+	free(p);
+	return NULL;
+    }
+    // walks external objects ahead of their plugins, see
+    // `amf3__push_precheck'
+    struct amf3_visit_context *s = p->c->shadow =
+	amf3_visit_context_new(NULL, 0, &g_visit_nothing, NULL);
+    if (!s || !(s->resume = CALLOC(1, struct amf3_visit_resume))) {
+	amf3_parse_context_free(p->c);
+	free(p);
+	return NULL;
+    }
+    p->status = AMF3_PUSH_MORE;
+    return p;
+}
+
+void amf3_push_parser_free(AMF3PushParser p) {
+    assert(p);
+    while (p->nframe > 0) {
+	struct amf3_push_frame *f = &p->frames[--p->nframe];
+	if (f->key)
+	    amf3_release(f->key);
+	amf3_release(f->container);
+    }
+    if (p->result)
+	amf3_release(p->result);
+    free(p->frames);
+    free(p->buffer);
+    amf3_parse_context_free(p->c);
+    free(p);
+}
+
+AMF3Value amf3_push_parser_take(AMF3PushParser p) {
+    AMF3Value v = p->result;
+    p->result = NULL;
+    return v;
+}
+
+Arena amf3_push_parser_detach_arena(AMF3PushParser p) {
+    if (!p->c->arena)
+	return NULL;
+    // a value still under construction cannot be finished without the arena
+    if (p->nframe > 0)
+	p->status = AMF3_PUSH_ERROR;
+    while (p->nframe > 0) {
+	struct amf3_push_frame *f = &p->frames[--p->nframe];
+	if (f->key)
+	    amf3_release(f->key);
+	amf3_release(f->container);
+    }
+    if (p->result) {
+	amf3_release(p->result);
+	p->result = NULL;
+    }
+    return amf3_parse_context_detach_arena(p->c);
+}
+
+static int amf3__push_frame(AMF3PushParser p,
+	AMF3Value container, char state, int len) {
+    if (amf3__depth_exceeded(__func__, p->nframe))
+	return -1;
+    if (p->nframe == p->frame_alloc) {
+	int n = p->frame_alloc ? p->frame_alloc * 2 : 16;
+	struct amf3_push_frame *frames = realloc(p->frames,
+		n * sizeof(struct amf3_push_frame));
+	if (!frames)
+	    return -1;
+	p->frames = frames;
+	p->frame_alloc = n;
+    }
+    struct amf3_push_frame *f = &p->frames[p->nframe++];
+    f->container = container;
+    f->key = NULL;
+    f->idx = 0;
+    f->len = len;
+    f->state = state;
+    return 0;
+}
+
+/* The table views an earlier attempt left point into its input, which may
+ * have moved since; those of strings parsed before are left alone. */
+static void amf3__push_rebase(struct amf3_visit_context *s,
+	int nstring, int ntraits) {
+    struct amf3_visit_resume *r = s->resume;
+    int i;
+    uintptr_t off;
+    if (r->data != s->data) {
+	for (i = nstring; i < r->nstring; i++) {
+	    off = (uintptr_t)s->strings[i].data - (uintptr_t)r->data;
+	    if (off < (uintptr_t)r->length)
+		s->strings[i].data = s->data + off;
+	}
+	for (i = ntraits; i < r->ntraits; i++) {
+	    off = (uintptr_t)s->traits[i].classname.data - (uintptr_t)r->data;
+	    if (off < (uintptr_t)r->length)
+		s->traits[i].classname.data = s->data + off;
+	}
+    }
+    r->data = s->data;
+    r->length = s->length;
+}
+
+/* Walks the externalizable object at `cp' without building anything, so
+ * that its plugin runs once, on all of it, rather than again on each feed
+ * until it stops running out of input.  A walk cut short resumes where it
+ * stood on the next feed.  returns 0 if the object is complete, otherwise
+ * -1, with `c->starved' set if more input may complete it. */
+static int amf3__push_precheck(struct amf3_parse_context *c,
+	const struct amf3__checkpoint *cp, AMF3Value traits) {
+    const struct amf3_plugin_parser *pp = amf3__traits_plugin(traits);
+    struct amf3_visit_context *s = c->shadow;
+    if (!pp || !pp->visitfunc)
+	return 0;
+    if (amf3__shadow_sync(c, cp->nobject, cp->nstring, cp->ntraits) != 0)
+	return -1;
+    s->data = s->p = cp->p;
+    s->length = s->left = cp->left;
+    s->starved = 0;
+    amf3__push_rebase(s, cp->nstring, cp->ntraits);
+
+    struct amf3_visit_resume *r = s->resume;
+    r->noted = 0;
+    int ret = amf3_visit_skip(s);
+    if (ret != 0 && s->starved) {
+	if (s->nstring > r->nstring)
+	    r->nstring = s->nstring;
+	if (s->ntraits > r->ntraits)
+	    r->ntraits = s->ntraits;
+	c->starved = 1;
+    } else
+	amf3__visit_resume_clear(r);
+    // what the walk added is only kept for resuming
+    s->nobject = cp->nobject;
+    s->nstring = cp->nstring;
+    s->ntraits = cp->ntraits;
+    return ret;
+}
+
+/* parses a whole value, or the header of an array or object whose contents
+ * follow through a new frame. */
+static int amf3__push_value(AMF3PushParser p, AMF3Value *out) {
+    struct amf3_parse_context *c = p->c;
+    struct amf3__checkpoint cp;
+    amf3__checkpoint_save(c, &cp);
+    if (!AMF3__NEED(c, 1))
+	return amf3__checkpoint_fail(c, &cp);
+
+    int ref;
+    AMF3Value v;
+    switch (*c->p) {
+	case AMF3_ARRAY:
+	    c->p++;
+	    c->left--;
+	    if ((ref = amf3_parse_u29(c)) < 0)
+		return amf3__checkpoint_fail(c, &cp);
+	    if (!(ref & 0x1))
+		break;
+	    if (!(v = amf3__new_array(c->arena)))
+		return AMF3__STEP_ERROR;
+	    amf3_ref_table_push(c->object_refs, v);
+	    if (amf3__push_frame(p, v, AMF3__FRAME_ASSOC, ref >> 1) != 0) {
+		amf3_release(v);
+		return AMF3__STEP_ERROR;
+	    }
+	    return AMF3__STEP_FRAME;
+
+	case AMF3_OBJECT:
+	    c->p++;
+	    c->left--;
+	    if ((ref = amf3_parse_u29(c)) < 0)
+		return amf3__checkpoint_fail(c, &cp);
+	    if (!(ref & 0x1))
+		break;
+	    if (!(v = amf3__parse_traits(c, ref)))
+		return amf3__checkpoint_fail(c, &cp);
+	    if (v->v.traits.externalizable &&
+		    amf3__push_precheck(c, &cp, v) != 0) {
+		amf3_release(v);
+		return amf3__checkpoint_fail(c, &cp);
+	    }
+	    AMF3Value obj = amf3__parse_object_start(c, v);
+	    amf3_release(v);
+	    if (!obj)
+		return amf3__checkpoint_fail(c, &cp);
+	    if (obj->v.object.traits->v.traits.externalizable) {
+		*out = obj;
+		return AMF3__STEP_VALUE;
+	    }
+	    if (amf3__push_frame(p, obj, AMF3__FRAME_SEALED, 0) != 0) {
+		amf3_release(obj);
+		return AMF3__STEP_ERROR;
+	    }
+	    return AMF3__STEP_FRAME;
+
+	default:
+	    if (!(*out = amf3_parse_value(c)))
+		return amf3__checkpoint_fail(c, &cp);
+	    return AMF3__STEP_VALUE;
+    }
+
+    // a reference to an array or object
+    if (!(v = amf3_ref_table_get(c->object_refs, ref >> 1))) {
+	LOG(LOG_ERROR, "%s: bad object reference %d\n", __func__, ref >> 1);
+	return AMF3__STEP_ERROR;
+    }
+    *out = amf3_retain(v);
+    return AMF3__STEP_VALUE;
+}
+
+/* hands a complete value over to the innermost open container. */
+static void amf3__push_deliver(AMF3PushParser p, AMF3Value v) {
+    if (p->nframe == 0) {
+	p->result = v;
+	return;
+    }
+    struct amf3_push_frame *f = &p->frames[p->nframe - 1];
+    switch (f->state) {
+	case AMF3__FRAME_ASSOC:
+	    amf3_array_assoc_set(f->container, f->key, v);
+	    break;
+
+	case AMF3__FRAME_DENSE:
+	    amf3_array_push(f->container, v);
+	    f->idx++;
+	    break;
+
+	case AMF3__FRAME_SEALED:
+	    // the object takes over our reference
+	    f->container->v.object.m.i.member_values[f->idx++] = v;
+	    return;
+
+	case AMF3__FRAME_DYNAMIC:
+	    amf3_object_prop_set(f->container, f->key, v);
+	    break;
+    }
+    if (f->key) {
+	amf3_release(f->key);
+	f->key = NULL;
+    }
+    amf3_release(v);
+}
+
+static int amf3__push_run(AMF3PushParser p) {
+    struct amf3_parse_context *c = p->c;
+    while (p->nframe > 0 || !p->result) {
+	struct amf3_push_frame *f = p->nframe ? &p->frames[p->nframe - 1] : NULL;
+	AMF3Value v;
+	int r;
+
+	if (f && f->state == AMF3__FRAME_SEALED &&
+		f->idx == f->container->v.object.traits->v.traits.nmemb) {
+	    if (f->container->v.object.traits->v.traits.dynamic) {
+		f->state = AMF3__FRAME_DYNAMIC;
+		continue;
+	    }
+	    goto complete;
+	}
+	if (f && f->state == AMF3__FRAME_DENSE && f->idx == f->len)
+	    goto complete;
+
+	if (f && !f->key && (f->state == AMF3__FRAME_ASSOC ||
+		    f->state == AMF3__FRAME_DYNAMIC)) {
+	    struct amf3__checkpoint cp;
+	    amf3__checkpoint_save(c, &cp);
+	    if (!(v = amf3__parse_name(c)))
+		return amf3__checkpoint_fail(c, &cp);
+	    if (amf3_string_len(v) > 0) {
+		f->key = v;
+		continue;
+	    }
+	    amf3_release(v);
+	    if (f->state == AMF3__FRAME_DYNAMIC)
+		goto complete;
+	    f->state = AMF3__FRAME_DENSE;
+	    if (amf3__array_reserve(f->container,
+			f->len < c->left ? f->len : c->left))
+		return AMF3__STEP_ERROR;
+	    continue;
+	}
+
+	if ((r = amf3__push_value(p, &v)) != AMF3__STEP_VALUE) {
+	    if (r == AMF3__STEP_FRAME)
+		continue;
+	    return r;
+	}
+	amf3__push_deliver(p, v);
+	continue;
+
+complete:
+	v = f->container;
+	p->nframe--;
+	amf3__push_deliver(p, v);
+    }
+    return AMF3__STEP_VALUE;
+}
+
+int amf3_push_parser_feed(AMF3PushParser p, const char *data, int length,
+	int *consumed) {
+    assert(p && length >= 0);
+    struct amf3_parse_context *c = p->c;
+    if (consumed)
+	*consumed = 0;
+    if (p->status != AMF3_PUSH_MORE)
+	return p->status;
+
+    // parse straight from `data' unless a token is pending
+    int carried = p->buffered;
+    if (carried > 0) {
+	if (carried + length > p->allocated) {
+	    int n = p->allocated ? p->allocated : 64;
+	    while (n < carried + length)
+		n *= 2;
+	    char *buffer = realloc(p->buffer, n);
+	    if (!buffer)
+		return (p->status = AMF3_PUSH_ERROR);
+	    p->buffer = buffer;
+	    p->allocated = n;
+	}
+	memcpy(p->buffer + carried, data, length);
+	p->buffered += length;
+	c->data = c->p = p->buffer;
+	c->length = c->left = p->buffered;
+    } else {
+	c->data = c->p = data;
+	c->length = c->left = length;
+    }
+
+    switch (amf3__push_run(p)) {
+	case AMF3__STEP_VALUE:
+	    // a pending token is always finished before the value
+	    assert(c->p - c->data >= carried);
+	    if (consumed)
+		*consumed = (c->p - c->data) - carried;
+	    p->buffered = 0;
+	    return (p->status = AMF3_PUSH_DONE);
+
+	case AMF3__STEP_MORE:
+	    if (c->left > p->allocated) {
+		char *buffer = realloc(p->buffer, c->left);
+		if (!buffer)
+		    return (p->status = AMF3_PUSH_ERROR);
+		p->buffer = buffer;
+		p->allocated = c->left;
+	    }
+	    if (c->left > 0 && c->p != p->buffer)
+		memmove(p->buffer, c->p, c->left);
+	    p->buffered = c->left;
+	    if (consumed)
+		*consumed = length;
+	    return AMF3_PUSH_MORE;
+
+	default:
+	    return (p->status = AMF3_PUSH_ERROR);
+    }
+}
+
+static const struct amf3_visitor g_visit_nothing;
+
+/* tables kept for the visitor a context was created with; nested skips
+ * must keep them as well for whatever the outer visit refers to later */
+#define AMF3__VISIT_OFFSETS (0x100)
+#define AMF3__VISIT_NAMES   (0x200)
+
+static void amf3__visit_context_init(struct amf3_visit_context *c,
+	const char *data, int length,
+	const struct amf3_visitor *visitor, void *ctx) {
+    c->data = c->p = data;
+    c->length = c->left = length;
+    c->starved = 0;
+    c->flags = 0;
+    c->depth = 0;
+    c->resume = NULL;
+    if (visitor->reference)
+	c->flags |= AMF3__VISIT_OFFSETS;
+    if (visitor->start_object || visitor->member)
+	c->flags |= AMF3__VISIT_NAMES;
+    c->visitor = visitor;
+    c->ctx = ctx;
+    c->strings = c->string_inline;
+    c->objects = c->object_inline;
+    c->traits = c->traits_inline;
+    c->names = c->name_inline;
+    c->nstring = c->nobject = c->ntraits = c->nname = 0;
+    c->string_alloc = c->object_alloc = c->traits_alloc = c->name_alloc =
+	AMF3_VISIT_INLINE;
+}
+
+static void amf3__visit_context_cleanup(struct amf3_visit_context *c) {
+    if (c->strings != c->string_inline)
+	free(c->strings);
+    if (c->objects != c->object_inline)
+	free(c->objects);
+    if (c->traits != c->traits_inline)
+	free(c->traits);
+    if (c->names != c->name_inline)
+	free(c->names);
+}
+
+AMF3VisitContext amf3_visit_context_new(const char *data, int length,
+	const struct amf3_visitor *visitor, void *ctx) {
+    AMF3VisitContext c = ALLOC(struct amf3_visit_context, 1);
+    if (c)
+	amf3__visit_context_init(c, data, length, visitor, ctx);
+    return c;
+}
+
+void amf3_visit_context_free(AMF3VisitContext c) {
+    assert(c);
+    amf3__visit_context_cleanup(c);
+    if (c->resume) {
+	free(c->resume->levels);
+	free(c->resume);
+    }
+    free(c);
+}
+
+/* makes room for one more item in a table that starts out in the inline
+ * storage `first'. returns 0 if success. */
+static int amf3__table_reserve(void *items, int *alloc, int count,
+	size_t size, void *first) {
+    if (count < *alloc)
+	return 0;
+    int n = *alloc * 2;
+    void *p;
+    if (*(void **)items == first) {
+	if ((p = malloc(n * size)) != NULL)
+	    memcpy(p, first, count * size);
+    } else
+	p = realloc(*(void **)items, n * size);
+    if (!p)
+	return -1;
+    *(void **)items = p;
+    *alloc = n;
+    return 0;
+}
+
+static int amf3__utf8_valid(const char *s, int len) {
+    const unsigned char *p = (const unsigned char *)s, *end = p + len;
+    while (p < end) {
+	unsigned int c = *p++;
+	int n;
+	unsigned int min;
+	if (c < 0x80)
+	    continue;
+	else if ((c & 0xE0) == 0xC0)
+	    n = 1, min = 0x80, c &= 0x1F;
+	else if ((c & 0xF0) == 0xE0)
+	    n = 2, min = 0x800, c &= 0x0F;
+	else if ((c & 0xF8) == 0xF0)
+	    n = 3, min = 0x10000, c &= 0x07;
+	else
+	    return 0;
+	if (end - p < n)
+	    return 0;
+	while (n-- > 0) {
+	    if ((*p & 0xC0) != 0x80)
+		return 0;
+	    c = (c << 6) | (*p++ & 0x3F);
+	}
+	// overlong forms, surrogates and beyond U+10FFFF
+	if (c < min || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+	    return 0;
+    }
+    return 1;
+}
+
+/* where an element of an array or object starts */
+struct amf3__visit_pos {
+    const char *p;
+    int nstring, nobject, ntraits;
+};
+
+static void amf3__visit_pos_save(struct amf3_visit_context *c,
+	struct amf3__visit_pos *pos) {
+    pos->p = c->p;
+    pos->nstring = c->nstring;
+    pos->nobject = c->nobject;
+    pos->ntraits = c->ntraits;
+}
+
+/* When resuming, records that the input ran out in the element at `pos' of
+ * the array or object at `offset'; the innermost level comes first, and
+ * replaces the previous path.  returns -1. */
+static int amf3__visit_resume_note(struct amf3_visit_context *c,
+	int offset, char state, int idx, const struct amf3__visit_pos *pos) {
+    struct amf3_visit_resume *r = c->resume;
+    int d = c->depth - 1;
+    if (!r || !c->starved)
+	return -1;
+    if (!r->noted) {
+	r->noted = 1;
+	r->nlevel = 0;
+	if (d >= r->level_alloc) {
+	    struct amf3__resume_level *levels = realloc(r->levels,
+		    (d + 1) * sizeof(struct amf3__resume_level));
+	    if (!levels)
+		return -1;
+	    r->levels = levels;
+	    r->level_alloc = d + 1;
+	}
+	int i;
+	for (i = 0; i <= d; i++)
+	    r->levels[i].offset = -1;
+	r->nlevel = d + 1;
+    }
+    if (d >= r->nlevel)
+	return -1;
+    struct amf3__resume_level *l = &r->levels[d];
+    l->offset = offset;
+    l->state = state;
+    l->idx = idx;
+    l->at = pos->p - c->data;
+    l->nstring = pos->nstring;
+    l->nobject = pos->nobject;
+    l->ntraits = pos->ntraits;
+    return -1;
+}
+
+/* moves to where the previous attempt ran out of input inside the array or
+ * object at `offset', if it did there.  Only skips resume, so the names
+ * and offsets tables are not restored. */
+static const struct amf3__resume_level *amf3__visit_resume_jump(
+	struct amf3_visit_context *c, int offset) {
+    struct amf3_visit_resume *r = c->resume;
+    int d = c->depth - 1;
+    if (!r || d >= r->nlevel || r->levels[d].offset != offset ||
+	    r->levels[d].at > c->length)
+	return NULL;
+    const struct amf3__resume_level *l = &r->levels[d];
+    c->p = c->data + l->at;
+    c->left = c->length - l->at;
+    c->nstring = l->nstring;
+    c->nobject = l->nobject;
+    c->ntraits = l->ntraits;
+    return l;
+}
+
+static int amf3__visit_u29(struct amf3_visit_context *c) {
+    int j;
+    int v = 0;
+    unsigned char i;
+
+    if (c->left >= 4) {
+	v = amf3__decode_u29(c->p, &j);
+	c->p += j;
+	c->left -= j;
+	return v;
+    }
+    for (j = 0; j < 3; j++) {
+	if (!AMF3__NEED(c, 1)) return -1;
+	i = *c->p++; c->left--;
+	v = (v << 7) | (i & 0x7F);
+	if (!(i & 0x80)) return v;
+    }
 
-	if (!external) {
-	    dynamic = (ref >> 3) & 1;
-	    nmemb = ref >> 4;
-	}
+    if (!AMF3__NEED(c, 1)) return -1;
+    i = *c->p++; c->left--;
+    return (v << 8) | i;
+}
 
-	traits = amf3__new_traits(classname, external, dynamic, nmemb);
-	if (!traits) {
-	    amf3_release(classname);
-	    return NULL;
+static int amf3__visit_string(struct amf3_visit_context *c,
+	struct amf3_strview *s) {
+    int len = amf3__visit_u29(c);
+    if (len < 0)
+	return -1;
+    if (!(len & 0x1)) {
+	if ((len >> 1) >= c->nstring) {
+	    LOG(LOG_ERROR, "%s: bad string reference %d\n", __func__, len >> 1);
+	    return -1;
 	}
+	*s = c->strings[len >> 1];
+	return 0;
+    }
+    if (!AMF3__NEED(c, len >>= 1))
+	return -1;
+    if ((c->flags & AMF3_VISIT_CHECK_UTF8) && !amf3__utf8_valid(c->p, len)) {
+	LOG(LOG_ERROR, "%s: string is not valid UTF-8\n", __func__);
+	return -1;
+    }
+    s->data = c->p;
+    s->length = len;
+    c->p += len;
+    c->left -= len;
+    if (len > 0) {
+	if (amf3__table_reserve(&c->strings, &c->string_alloc,
+		    c->nstring, sizeof(struct amf3_strview), c->string_inline))
+	    return -1;
+	c->strings[c->nstring++] = *s;
+    }
+    return 0;
+}
 
-	int i;
-	for (i = 0; i < nmemb; i++) {
-	    AMF3Value key = amf3_parse_string(c);
-	    if (!key) {
-		amf3_release(traits);
-		amf3_release(classname);
-		return NULL;
-	    }
-	    amf3__traits_member_set(traits, i, key);
-	    amf3_release(key);
+/* reads the header of a date, XML, ByteArray, array or object. returns 1
+ * if it was a reference, which is reported, 0 if the value follows, or -1
+ * on error. */
+static int amf3__visit_header(struct amf3_visit_context *c,
+	int offset, int *header) {
+    if ((*header = amf3__visit_u29(c)) < 0)
+	return -1;
+    if (!(*header & 0x1)) {
+	int idx = *header >> 1;
+	if (idx >= c->nobject) {
+	    LOG(LOG_ERROR, "%s: bad object reference %d\n", __func__, idx);
+	    return -1;
 	}
-
-	amf3_ref_table_push(c->traits_refs, traits);
-
-	LOG(LOG_DEBUG, "[TRAITS]{%d}[%s%s] %s\n",
-		c->traits_refs->nref - 1,
-		external ? "E" : " ",
-		dynamic ? "D" : " ",
-		amf3_string_cstr(classname));
+	if (c->visitor->reference &&
+		c->visitor->reference(c->ctx, idx, c->objects[idx]))
+	    return -1;
+	return 1;
     }
+    // only references need the offsets, and otherwise only their count
+    if (c->flags & AMF3__VISIT_OFFSETS) {
+	if (amf3__table_reserve(&c->objects, &c->object_alloc,
+		    c->nobject, sizeof(int), c->object_inline))
+	    return -1;
+	c->objects[c->nobject] = offset;
+    }
+    c->nobject++;
+    return 0;
+}
 
-    AMF3Value obj;
-    if (external) {
-	obj = amf3__new_object_external_direct(traits, NULL);
-	if (!obj) {
-	    amf3_release(traits);
-	    amf3_release(classname);
-	    return NULL;
-	}
-	amf3_ref_table_push(c->object_refs, obj);
-
-	const struct amf3_plugin_parser *pp;
-	if ((pp = amf3__find_plugin_parser(classname)) != NULL) {
-	    if (pp->handler(c, classname,
-			&obj->v.object.m.external_ctx) != 0) {
-		LOG(LOG_ERROR, "%s: external parser of type '%s' returns error\n",
-			__func__, amf3_string_cstr(classname));
-		amf3_release(traits);
-		amf3_release(classname);
-		amf3_release(obj);
-		return NULL;
-	    }
-	} else {
-	    LOG(LOG_ERROR, "%s: cannot parse type '%s'\n",
-		    __func__, amf3_string_cstr(classname));
-	    amf3_release(traits);
-	    amf3_release(classname);
-	    amf3_release(obj);
-	    return NULL;
-	}
-    } else {
-	obj = amf3__new_object_direct(traits, NULL, list_new());
-	if (!obj) {
-	    amf3_release(traits);
-	    amf3_release(classname);
-	    return NULL;
-	}
-	amf3_ref_table_push(c->object_refs, obj);
+static int amf3__visit_end(struct amf3_visit_context *c) {
+    return (c->visitor->end && c->visitor->end(c->ctx)) ? -1 : 0;
+}
 
-	int i, nmemb = traits->v.traits.nmemb;
-	for (i = 0; i < nmemb; i++) {
-	    LOG(LOG_DEBUG, "%s::%s\n",
-		    amf3_string_cstr(traits->v.traits.type),
-		    amf3_string_cstr(traits->v.traits.members[i]));
+static int amf3__visit_keyed_values(struct amf3_visit_context *c,
+	int offset, char state) {
+    struct amf3_strview key;
+    struct amf3__visit_pos pos;
+    for (;;) {
+	amf3__visit_pos_save(c, &pos);
+	if (amf3__visit_string(c, &key) != 0)
+	    return amf3__visit_resume_note(c, offset, state, 0, &pos);
+	if (key.length == 0)
+	    return 0;
+	if (amf3_visit_key(c, key.data, key.length) != 0 ||
+		amf3_visit_value(c) != 0)
+	    return amf3__visit_resume_note(c, offset, state, 0, &pos);
+    }
+}
 
-	    AMF3Value value = amf3_parse_value(c);
-	    if (!value) {
-		amf3_release(traits);
-		amf3_release(classname);
-		amf3_release(obj);
-		return NULL;
-	    }
-	    obj->v.object.m.i.member_values[i] = value;
+static int amf3__visit_array(struct amf3_visit_context *c, int offset) {
+    int len, r;
+    if ((r = amf3__visit_header(c, offset, &len)) != 0)
+	return r < 0 ? -1 : 0;
+    len >>= 1;
+    if (c->visitor->start_array && c->visitor->start_array(c->ctx, len))
+	return -1;
+    const struct amf3__resume_level *l = amf3__visit_resume_jump(c, offset);
+    int i = 0;
+    if (l && l->state == AMF3__FRAME_DENSE)
+	i = l->idx;
+    else if (amf3__visit_keyed_values(c, offset, AMF3__FRAME_ASSOC) != 0)
+	return -1;
+    struct amf3__visit_pos pos;
+    for (; i < len; i++) {
+	amf3__visit_pos_save(c, &pos);
+	if (amf3_visit_value(c) != 0)
+	    return amf3__visit_resume_note(c, offset,
+		    AMF3__FRAME_DENSE, i, &pos);
+    }
+    return amf3__visit_end(c);
+}
 
-#if DEBUG_LEVEL >= LOG_DEBUG
-	    if (value->type != AMF3_OBJECT && value->type != AMF3_ARRAY) {
-		LOG(LOG_DEBUG, "=> ");
-		amf3_dump_value(value, 0);
-	    }
-#endif
+static int amf3__visit_traits(struct amf3_visit_context *c,
+	int ref, struct amf3_visit_traits *t) {
+    if ((ref & 0x3) == 0x1) {
+	if ((ref >> 2) >= c->ntraits) {
+	    LOG(LOG_ERROR, "%s: bad traits reference %d\n", __func__, ref >> 2);
+	    return -1;
 	}
+	*t = c->traits[ref >> 2];
+	return 0;
+    }
 
-	if (dynamic) {
-	    AMF3Value key;
-	    while ((key = amf3_parse_string(c)) != NULL &&
-		    amf3_string_len(key) > 0) {
-		AMF3Value value = amf3_parse_value(c);
-		if (!value) {
-		    amf3_release(traits);
-		    amf3_release(classname);
-		    amf3_release(obj);
-		    amf3_release(key);
-		    return NULL;
-		}
-		amf3_object_prop_set(obj, key, value);
-		amf3_release(key);
-		amf3_release(value);
-	    }
-	    if (key)
-		amf3_release(key);
-	}
+    t->externalizable = ((ref & 0x7) == 0x7) ? 1 : 0;
+    t->dynamic = 0;
+    t->nmemb = 0;
+    if (!t->externalizable) {
+	t->dynamic = (ref >> 3) & 1;
+	t->nmemb = ref >> 4;
     }
-    amf3_release(traits);
-    amf3_release(classname);
-    return obj;
+    if (amf3__visit_string(c, &t->classname) != 0)
+	return -1;
+    int keep = c->flags & AMF3__VISIT_NAMES;
+    t->members = c->nname;
+    int i;
+    for (i = 0; i < t->nmemb; i++) {
+	struct amf3_strview name;
+	if (amf3__visit_string(c, &name) != 0)
+	    return -1;
+	if (!keep)
+	    continue;
+	if (amf3__table_reserve(&c->names, &c->name_alloc,
+		    c->nname, sizeof(struct amf3_strview), c->name_inline))
+	    return -1;
+	c->names[c->nname++] = name;
+    }
+    if (amf3__table_reserve(&c->traits, &c->traits_alloc,
+		c->ntraits, sizeof(struct amf3_visit_traits), c->traits_inline))
+	return -1;
+    c->traits[c->ntraits++] = *t;
+    return 0;
 }
 
-static double amf3__read_double(struct amf3_parse_context *c) {
-    union {
-	uint64_t i;
-	double d;
-    } conv;
-    if (c->left < sizeof(uint64_t))
-	return 0.0;
-    conv.i = NTOH64(*((uint64_t *)c->p));
-    c->p += sizeof(uint64_t);
-    c->left -= sizeof(uint64_t);
-    return conv.d;
-}
+static int amf3__visit_object(struct amf3_visit_context *c, int offset) {
+    int ref, r;
+    if ((r = amf3__visit_header(c, offset, &ref)) != 0)
+	return r < 0 ? -1 : 0;
+
+    // a copy, since nested values may grow the tables
+    struct amf3_visit_traits t;
+    if (amf3__visit_traits(c, ref, &t) != 0)
+	return -1;
+    if (c->visitor->start_object &&
+	    c->visitor->start_object(c->ctx, &t,
+		t.nmemb > 0 ? c->names + t.members : NULL))
+	return -1;
+
+    if (t.externalizable) {
+	const struct amf3_plugin_parser *pp =
+	    amf3__find_plugin(t.classname.data, t.classname.length);
+	if (!pp || !pp->visitfunc) {
+	    LOG(LOG_ERROR, "%s: cannot visit type '%.*s'\n", __func__,
+		    t.classname.length, t.classname.data);
+	    return -1;
+	}
+	if (pp->visitfunc(c, t.classname.data, t.classname.length) != 0)
+	    return -1;
+	return amf3__visit_end(c);
+    }
 
-AMF3Value amf3_parse_date(struct amf3_parse_context *c) {
-    int ref = amf3_parse_u29(c);
-    if (ref < 0)
-	return NULL;
-    if (!(ref & 0x1))
-	return amf3_retain(amf3_ref_table_get(c->object_refs, ref >> 1));
-    return amf3_ref_table_push(c->object_refs,
-	    amf3_new_date(amf3__read_double(c)));
+    const struct amf3__resume_level *l = amf3__visit_resume_jump(c, offset);
+    int i = 0;
+    if (l)
+	i = l->state == AMF3__FRAME_SEALED ? l->idx : t.nmemb;
+    struct amf3__visit_pos pos;
+    for (; i < t.nmemb; i++) {
+	if (c->visitor->member && c->visitor->member(c->ctx, i,
+		    c->names[t.members + i].data, c->names[t.members + i].length))
+	    return -1;
+	amf3__visit_pos_save(c, &pos);
+	if (amf3_visit_value(c) != 0)
+	    return amf3__visit_resume_note(c, offset,
+		    AMF3__FRAME_SEALED, i, &pos);
+    }
+    if (t.dynamic &&
+	    amf3__visit_keyed_values(c, offset, AMF3__FRAME_DYNAMIC) != 0)
+	return -1;
+    return amf3__visit_end(c);
 }
 
-AMF3Value amf3_parse_value(struct amf3_parse_context *c) {
-    assert(c->left > 0);
+int amf3_visit_value(AMF3VisitContext c) {
+    const struct amf3_visitor *v = c->visitor;
+    if (!AMF3__NEED(c, 1))
+	return -1;
+    int offset = c->p - c->data;
     char mark = *c->p++;
     c->left--;
+
+    int header, r;
+    struct amf3_strview s;
     switch (mark) {
 	case AMF3_UNDEFINED:
-	    return amf3_new_undefined();
-
 	case AMF3_NULL:
-	    return amf3_new_null();
-
 	case AMF3_FALSE:
-	    return amf3_new_false();
-
 	case AMF3_TRUE:
-	    return amf3_new_true();
+	    return (v->atom && v->atom(c->ctx, mark)) ? -1 : 0;
 
 	case AMF3_INTEGER:
-	    {
-		int integer = amf3_parse_u29(c);
-		if (integer < 0)
-		    return NULL;
-		return amf3_new_integer((integer << 3) >> 3);
-	    }
+	    if ((header = amf3__visit_u29(c)) < 0)
+		return -1;
+	    return (v->integer &&
+		    v->integer(c->ctx, (header << 3) >> 3)) ? -1 : 0;
 
 	case AMF3_DOUBLE:
-	    return amf3_new_double(amf3__read_double(c));
+	    if (!AMF3__NEED(c, (int)sizeof(uint64_t)))
+		return -1;
+	    c->p += sizeof(uint64_t);
+	    c->left -= sizeof(uint64_t);
+	    return (v->real && v->real(c->ctx,
+			amf3__decode_double(c->p - sizeof(uint64_t)))) ? -1 : 0;
 
 	case AMF3_STRING:
-	    return amf3_parse_string(c);
+	    if (amf3__visit_string(c, &s) != 0)
+		return -1;
+	    return (v->string && v->string(c->ctx, s.data, s.length)) ? -1 : 0;
 
 	case AMF3_XMLDOC:
 	case AMF3_XML:
 	case AMF3_BYTEARRAY:
-	    return amf3__parse_binary_object(c, mark);
+	    if ((r = amf3__visit_header(c, offset, &header)) != 0)
+		return r < 0 ? -1 : 0;
+	    if (!AMF3__NEED(c, header >>= 1))
+		return -1;
+	    c->p += header;
+	    c->left -= header;
+	    return (v->binary && v->binary(c->ctx, mark,
+			c->p - header, header)) ? -1 : 0;
 
 	case AMF3_DATE:
-	    return amf3_parse_date(c);
+	    if ((r = amf3__visit_header(c, offset, &header)) != 0)
+		return r < 0 ? -1 : 0;
+	    if (!AMF3__NEED(c, (int)sizeof(uint64_t)))
+		return -1;
+	    c->p += sizeof(uint64_t);
+	    c->left -= sizeof(uint64_t);
+	    return (v->date && v->date(c->ctx,
+			amf3__decode_double(c->p - sizeof(uint64_t)))) ? -1 : 0;
 
 	case AMF3_ARRAY:
-	    return amf3_parse_array(c);
-
 	case AMF3_OBJECT:
-	    return amf3_parse_object(c);
+	    if (amf3__depth_exceeded(__func__, c->depth))
+		return -1;
+	    c->depth++;
+	    r = mark == AMF3_ARRAY ? amf3__visit_array(c, offset)
+		: amf3__visit_object(c, offset);
+	    c->depth--;
+	    return r;
 
 	default:
 	    LOG(LOG_ERROR, "%s: unknown type %02X\n", __func__, mark);
-	    return NULL;
+	    return -1;
     }
 }
 
-AMF3ParseContext amf3_parse_context_new(const char *data, int length) {
-    AMF3ParseContext c = CALLOC(1, struct amf3_parse_context);
-    if (c) {
-	c->data = c->p = data;
-	c->length = c->left = length;
-	c->object_refs = amf3_ref_table_new();
-	c->string_refs = amf3_ref_table_new();
-	c->traits_refs = amf3_ref_table_new();
+int amf3_visit_skip(AMF3VisitContext c) {
+    const struct amf3_visitor *visitor = c->visitor;
+    c->visitor = &g_visit_nothing;
+    int r = amf3_visit_value(c);
+    c->visitor = visitor;
+    return r;
+}
+
+int amf3_visit_key(AMF3VisitContext c, const char *name, int length) {
+    return (c->visitor->key && c->visitor->key(c->ctx, name, length)) ? -1 : 0;
+}
+
+static int amf3__walk(const char *data, int length, int flags, int *starved) {
+    struct amf3_visit_context c;
+    amf3__visit_context_init(&c, data, length, &g_visit_nothing, NULL);
+    c.flags |= flags;
+    int r = amf3_visit_value(&c);
+    amf3__visit_context_cleanup(&c);
+    *starved = c.starved;
+    return r == 0 ? c.p - c.data : -1;
+}
+
+int amf3_skip_value(const char *data, int length) {
+    int starved;
+    int r = amf3__walk(data, length, 0, &starved);
+    return (r < 0 && starved) ? 0 : r;
+}
+
+int amf3_validate_value(const char *data, int length) {
+    int starved;
+    return amf3__walk(data, length, AMF3_VISIT_CHECK_UTF8, &starved) == length
+	? 0 : -1;
+}
+
+AMF3Path amf3_path_compile(const char *expr) {
+    assert(expr);
+    AMF3Path path = CALLOC(1, struct amf3_path);
+    if (!path)
+	return NULL;
+    // every step but the first starts with '.' or '['
+    int nalloc = 1;
+    const char *p;
+    for (p = expr; *p; p++)
+	if (*p == '.' || *p == '[')
+	    nalloc++;
+    path->steps = CALLOC(nalloc, struct amf3_path_step);
+    if (!path->steps) {
+	free(path);
+	return NULL;
     }
-    return c;
+
+    p = expr;
+    while (*p) {
+	struct amf3_path_step *step = &path->steps[path->nstep];
+	if (*p == '[') {
+	    if (p[1] == '*' && p[2] == ']') {
+		step->kind = AMF3_PATH_EACH;
+		p += 3;
+	    } else {
+		char *end;
+		long idx = strtol(p + 1, &end, 10);
+		// dense arrays are no longer than a U29
+		if (end == p + 1 || *end != ']' || p[1] == '-' || p[1] == '+' ||
+			idx > 0x0fffffff)
+		    goto bad;
+		step->kind = AMF3_PATH_INDEX;
+		step->index = (int)idx;
+		p = end + 1;
+	    }
+	} else {
+	    if (*p == '.')
+		p++;
+	    else if (path->nstep > 0)
+		goto bad;
+	    int len = strcspn(p, ".[");
+	    if (len == 0)
+		goto bad;
+	    if (len == 1 && *p == '*') {
+		step->kind = AMF3_PATH_ALL;
+	    } else {
+		AMF3Value key = amf3_intern(p, len);
+		if (!key)
+		    goto fail;
+		step->kind = AMF3_PATH_KEY;
+		amf3_accessor_init(&step->acc, NULL, key);
+		amf3_release(key);
+	    }
+	    p += len;
+	}
+	path->nstep++;
+    }
+    return path;
+
+bad:
+    LOG(LOG_ERROR, "%s: bad path '%s' at offset %d\n",
+	    __func__, expr, (int)(p - expr));
+fail:
+    amf3_path_free(path);
+    return NULL;
 }
 
-void amf3_parse_context_free(AMF3ParseContext c) {
-    assert(c);
-    if (c->object_refs)
-	amf3_ref_table_free(c->object_refs);
-    if (c->string_refs)
-	amf3_ref_table_free(c->string_refs);
-    if (c->traits_refs)
-	amf3_ref_table_free(c->traits_refs);
-    free(c);
+void amf3_path_free(AMF3Path path) {
+    int i;
+    for (i = 0; i < path->nstep; i++)
+	if (path->steps[i].kind == AMF3_PATH_KEY)
+	    amf3_accessor_cleanup(&path->steps[i].acc);
+    free(path->steps);
+    free(path);
+}
+
+struct amf3_path_walk {
+    AMF3Path path;
+    AMF3PathMatchFunc func;
+    void *ctx;
+    int nmatch;
+    int step;			/* for `amf3__path_each_cb' */
+    int stop;			/* 1 when stopped, -1 on error */
+};
+
+static int amf3__path_walk(struct amf3_path_walk *w, int i, AMF3Value v);
+
+static void amf3__path_each_cb(AMF3Value v, void *CTX) {
+    struct amf3_path_walk *w = (struct amf3_path_walk *)CTX;
+    if (!w->stop && v)
+	w->stop = amf3__path_walk(w, w->step, v);
+}
+
+static int amf3__path_walk_kvmap(struct amf3_path_walk *w, int i,
+	struct amf3_kvmap *m) {
+    int j, r = 0;
+    for (j = 0; j < m->count && r == 0; j++)
+	r = amf3__path_walk(w, i, m->entries[j].value);
+    return r;
+}
+
+/* matches `v' against the steps from `i' on.  returns 0 to go on, 1 if
+ * stopped by the callback, or -1 on error. */
+static int amf3__path_walk(struct amf3_path_walk *w, int i, AMF3Value v) {
+    if (i == w->path->nstep) {
+	w->nmatch++;
+	return w->func(v, w->ctx) ? 1 : 0;
+    }
+    if (v->type != AMF3_ARRAY && v->type != AMF3_OBJECT)
+	return 0;
+    if (!amf3__force(v))
+	return -1;
+
+    struct amf3_path_step *step = &w->path->steps[i];
+    AMF3Value child = NULL;
+    int j, r = 0;
+    switch (step->kind) {
+	case AMF3_PATH_KEY:
+	    if (v->type == AMF3_OBJECT)
+		child = amf3_accessor_get(&step->acc, v);
+	    else
+		child = amf3__kvmap_get(v->v.array.assoc, step->acc.key);
+	    break;
+
+	case AMF3_PATH_INDEX:
+	    if (v->type == AMF3_ARRAY)
+		child = amf3_array_get(v, step->index);
+	    break;
+
+	case AMF3_PATH_EACH:
+	    if (v->type != AMF3_ARRAY)
+		break;
+	    for (j = 0; j < v->v.array.ndense && r == 0; j++)
+		r = amf3__path_walk(w, i + 1, v->v.array.dense[j]);
+	    return r;
+
+	case AMF3_PATH_ALL:
+	    if (v->type == AMF3_ARRAY)
+		return amf3__path_walk_kvmap(w, i + 1, v->v.array.assoc);
+	    {
+		struct amf3_traits *t = &v->v.object.traits->v.traits;
+		if (t->externalizable) {
+		    const struct amf3_plugin_parser *pp =
+			amf3__traits_plugin(v->v.object.traits);
+		    if (!pp || !pp->foreachfunc || !v->v.object.m.external_ctx)
+			return 0;
+		    int step = w->step;
+		    w->step = i + 1;
+		    pp->foreachfunc(v->v.object.m.external_ctx,
+			    amf3__path_each_cb, w);
+		    w->step = step;
+		    r = w->stop;
+		    w->stop = 0;
+		    return r;
+		}
+		for (j = 0; j < t->nmemb && r == 0; j++)
+		    if (v->v.object.m.i.member_values[j])
+			r = amf3__path_walk(w, i + 1,
+				v->v.object.m.i.member_values[j]);
+		if (r == 0)
+		    r = amf3__path_walk_kvmap(w, i + 1,
+			    v->v.object.m.i.dynmemb);
+		return r;
+	    }
+    }
+    return child ? amf3__path_walk(w, i + 1, child) : 0;
+}
+
+int amf3_path_eval(AMF3Path path, AMF3Value v,
+	AMF3PathMatchFunc func, void *ctx) {
+    struct amf3_path_walk w;
+    memset(&w, 0, sizeof(w));
+    w.path = path;
+    w.func = func;
+    w.ctx = ctx;
+    return amf3__path_walk(&w, 0, v) < 0 ? -1 : w.nmatch;
+}
+
+int amf3_path_query(AMF3Path path, const char *data, int length, int flags,
+	AMF3PathMatchFunc func, void *ctx) {
+    AMF3ParseContext c = amf3_parse_context_new_ex(data, length,
+	    flags | AMF3_PARSE_LAZY);
+    if (!c)
+	return -1;
+    AMF3Value v = amf3_parse_value(c);
+    int n = v ? amf3_path_eval(path, v, func, ctx) : -1;
+
+    // the accessors must not keep traits from the arena
+    int i;
+    for (i = 0; i < path->nstep; i++) {
+	struct amf3_accessor *acc = &path->steps[i].acc;
+	if (path->steps[i].kind == AMF3_PATH_KEY && acc->traits &&
+		(acc->traits->flags & AMF3_VALUE_ARENA)) {
+	    acc->traits = NULL;
+	    acc->slot = AMF3_ACCESSOR_NONE;
+	}
+    }
+    amf3_parse_context_free(c);
+    return n;
 }
 
 void amf3__print_indent(int indent) {
@@ -1058,23 +4126,13 @@ void amf3__print_indent(int indent) {
 
 void amf3_dump_value(AMF3Value v, int depth);
 
-static void *amf3__dump_kv(
-	List list, int idx, void *INLIST, void *DEPTH) {
-    struct amf3_kv *kv = (struct amf3_kv *)INLIST;
-    int depth = *((int *)DEPTH);
-    amf3__print_indent(depth);
-    fprintf(stderr, "\"%s\": ", amf3_string_cstr(kv->key));
-    amf3_dump_value(kv->value, depth + 1);
-    return NULL;
-}
-
-static void *amf3__dump_v(
-	List list, int idx, void *value, void *DEPTH) {
-    int depth = *((int *)DEPTH);
-    amf3__print_indent(depth);
-    fprintf(stderr, "[%d] ", idx);
-    amf3_dump_value((AMF3Value)value, depth + 1);
-    return NULL;
+static void amf3__dump_kvmap(struct amf3_kvmap *m, int depth) {
+    int i;
+    for (i = 0; i < m->count; i++) {
+	amf3__print_indent(depth);
+	fprintf(stderr, "\"%.*s\": ", STRARG(m->entries[i].key));
+	amf3_dump_value(m->entries[i].value, depth + 1);
+    }
 }
 
 void amf3_dump_value(AMF3Value v, int depth) {
@@ -1086,6 +4144,10 @@ void amf3_dump_value(AMF3Value v, int depth) {
     };
     if (v->type <= AMF3_BYTEARRAY)
 	fprintf(fp, "(%s)", typenames[(int)v->type]);
+    if (!amf3__force(v)) {
+	fprintf(fp, " <undecodable>\n");
+	return;
+    }
     switch (v->type) {
 	case AMF3_UNDEFINED:
 	case AMF3_NULL:
@@ -1117,12 +4179,16 @@ void amf3_dump_value(AMF3Value v, int depth) {
 
 	case AMF3_ARRAY:
 	    {
-		int nxdepth = depth + 1;
 		fprintf(fp, "\n");
 		amf3__print_indent(depth);
 		fprintf(fp, "(assoc)\n");
-		list_foreach(v->v.array.assoc_list, amf3__dump_kv, &nxdepth);
-		list_foreach(v->v.array.dense_list, amf3__dump_v, &depth);
+		amf3__dump_kvmap(v->v.array.assoc, depth + 1);
+		int i;
+		for (i = 0; i < v->v.array.ndense; i++) {
+		    amf3__print_indent(depth);
+		    fprintf(fp, "[%d] ", i);
+		    amf3_dump_value(v->v.array.dense[i], depth + 1);
+		}
 	    }
 	    break;
 
@@ -1135,7 +4201,7 @@ void amf3_dump_value(AMF3Value v, int depth) {
 
 		if (traits->v.traits.externalizable) {
 		    const struct amf3_plugin_parser *pp =
-			amf3__find_plugin_parser(traits->v.traits.type);
+			amf3__traits_plugin(traits);
 		    if (pp && pp->dumpfunc)
 			pp->dumpfunc(v->v.object.m.external_ctx, depth);
 		    else {
@@ -1146,8 +4212,8 @@ void amf3_dump_value(AMF3Value v, int depth) {
 		    int i;
 		    for (i = 0; i < traits->v.traits.nmemb; i++) {
 			amf3__print_indent(depth);
-			fprintf(fp, "\"%s\": ",
-				amf3_string_cstr(traits->v.traits.members[i]));
+			fprintf(fp, "\"%.*s\": ",
+				STRARG(traits->v.traits.members[i]));
 			amf3_dump_value(
 				v->v.object.m.i.member_values[i], depth + 1);
 		    }
@@ -1155,19 +4221,17 @@ void amf3_dump_value(AMF3Value v, int depth) {
 		    if (traits->v.traits.dynamic) {
 			amf3__print_indent(depth);
 			fprintf(fp, "(dynmember)\n");
-			int nxdepth = depth + 1;
-			list_foreach(v->v.object.m.i.dynmemb_list,
-				amf3__dump_kv, &nxdepth);
+			amf3__dump_kvmap(v->v.object.m.i.dynmemb, depth + 1);
 		    }
 		}
 	    }
 	    break;
 
 	case AMF3_TRAITS:
-	    fprintf(fp, "<traits> [%s%s] %s\n",
+	    fprintf(fp, "<traits> [%s%s] %.*s\n",
 		    v->v.traits.externalizable ? "E" : " ",
 		    v->v.traits.dynamic ? "D" : " ",
-		    amf3_string_cstr(v->v.traits.type));
+		    STRARG(v->v.traits.type));
 	    break;
 
 	default:
@@ -1175,20 +4239,26 @@ void amf3_dump_value(AMF3Value v, int depth) {
     }
 }
 
-AMF3SerializeContext amf3_serialize_context_new() {
+static AMF3SerializeContext amf3__serialize_context_new(int flags,
+	char *buffer, int size) {
     AMF3SerializeContext c = CALLOC(1, struct amf3_serialize_context);
     if (c) {
-	c->object_refs = amf3_ref_table_new();
-	c->string_refs = amf3_ref_table_new();
-	c->traits_refs = amf3_ref_table_new();
+	c->flags = flags;
+	c->object_refs = amf3_ref_table_new_indexed();
+	c->string_refs = amf3_ref_table_new_indexed();
+	c->traits_refs = amf3_ref_table_new_indexed();
 	if (!c->object_refs || !c->string_refs || !c->traits_refs) {
 	    amf3_serialize_context_free(c);
 	    return NULL;
 	}
-
-	c->allocated = 1024;
-	c->buffer = ALLOC(char, c->allocated);
-	if (!c->buffer) {
+	c->object_refs->borrow_frozen = 1;
+	c->string_refs->borrow_frozen = 1;
+	c->traits_refs->borrow_frozen = 1;
+
+	c->allocated = size;
+	c->buffer = buffer;
+	if (!(flags & (AMF3_SERIALIZE_MEASURE | AMF3_SERIALIZE_FIXED)) &&
+		!(c->buffer = ALLOC(char, c->allocated))) {
 	    amf3_serialize_context_free(c);
 	    return NULL;
 	}
@@ -1197,10 +4267,38 @@ AMF3SerializeContext amf3_serialize_context_new() {
     return c;
 }
 
+AMF3SerializeContext amf3_serialize_context_new() {
+    return amf3__serialize_context_new(0, NULL, 1024);
+}
+
+AMF3SerializeContext amf3_serialize_context_new_ex(int flags) {
+    assert(!(flags & (AMF3_SERIALIZE_FIXED | AMF3_SERIALIZE_SINK)));
+    return amf3__serialize_context_new(flags, NULL, 1024);
+}
+
+AMF3SerializeContext amf3_serialize_context_new_sink(
+	AMF3SerializeSinkFunc sink, void *ctx, int size) {
+    assert(sink && size >= 0);
+    AMF3SerializeContext c = amf3__serialize_context_new(AMF3_SERIALIZE_SINK,
+	    NULL, size ? size : 65536);
+    if (c) {
+	c->sink = sink;
+	c->sink_ctx = ctx;
+    }
+    return c;
+}
+
+AMF3SerializeContext amf3_serialize_context_new_buffer(char *buffer, int size) {
+    assert(buffer || size == 0);
+    return amf3__serialize_context_new(AMF3_SERIALIZE_FIXED, buffer, size);
+}
+
 void amf3_serialize_context_free(AMF3SerializeContext c) {
     assert(c);
-    if (c->buffer)
+    if (c->buffer && !(c->flags & AMF3_SERIALIZE_FIXED))
 	free(c->buffer);
+    free(c->segments);
+    free(c->iov);
     if (c->object_refs)
 	amf3_ref_table_free(c->object_refs);
     if (c->string_refs)
@@ -1210,14 +4308,86 @@ void amf3_serialize_context_free(AMF3SerializeContext c) {
     free(c);
 }
 
+/* offers `len' bytes to the sink until it has taken all of them. */
+static int amf3__serialize_sink(AMF3SerializeContext c,
+	const char *data, int len) {
+    while (len > 0) {
+	int n = c->sink(c->sink_ctx, data, len);
+	if (n < 0 || n > len) {
+	    LOG(LOG_ERROR, "%s: sink failed\n", __func__);
+	    c->failed = 1;
+	    return -1;
+	}
+	data += n;
+	len -= n;
+	c->flushed += n;
+    }
+    return 0;
+}
+
+void amf3_serialize_context_reset(AMF3SerializeContext c) {
+    amf3_ref_table_reset(c->object_refs);
+    amf3_ref_table_reset(c->string_refs);
+    amf3_ref_table_reset(c->traits_refs);
+    c->length = 0;
+    c->failed = 0;
+    c->nsegment = 0;
+    c->segmented = 0;
+    c->flushed = 0;
+}
+
+int amf3_serialize_context_flush(AMF3SerializeContext c) {
+    if (c->failed)
+	return -1;
+    if (!(c->flags & AMF3_SERIALIZE_SINK))
+	return 0;
+    if (amf3__serialize_sink(c, c->buffer, c->length) != 0)
+	return -1;
+    c->length = 0;
+    return 0;
+}
+
+int amf3_serialize_context_reserve(AMF3SerializeContext c, int size) {
+    if (c->flags & AMF3_SERIALIZE_MEASURE || c->length + size <= c->allocated)
+	return 0;
+    if (c->flags & AMF3_SERIALIZE_SINK) {
+	// a flush empties the buffer, but does not make it any larger
+	if (amf3_serialize_context_flush(c) != 0)
+	    return -1;
+	return size <= c->allocated ? 0 : -1;
+    }
+    if (c->flags & AMF3_SERIALIZE_FIXED || c->length + size < c->length)
+	return -1;
+    int allocated = c->allocated > 0 ? c->allocated : 1024;
+    while (allocated > 0 && c->length + size > allocated)
+	allocated <<= 1;
+    if (allocated <= 0)
+	allocated = c->length + size;
+    char *p = realloc(c->buffer, allocated);
+    if (!p)
+	return -1;
+    c->buffer = p;
+    c->allocated = allocated;
+    return 0;
+}
+
 int amf3_serialize_write_func(AMF3SerializeContext c, const void *data, int len) {
-    if (c->length + len > c->allocated) {
-	while (c->allocated >= 0 && c->length + len > c->allocated)
-	    c->allocated <<= 1;
-	char *p = realloc(c->buffer, c->allocated);
-	if (!p)
+    if (c->failed)
+	return -1;
+    if (c->flags & AMF3_SERIALIZE_MEASURE) {
+	c->length += len;
+	return len;
+    }
+    if (c->flags & AMF3_SERIALIZE_SINK && c->length + len > c->allocated) {
+	if (amf3_serialize_context_flush(c) != 0)
 	    return -1;
-	c->buffer = p;
+	// too long to buffer: hand it over as it is
+	if (len >= c->allocated)
+	    return amf3__serialize_sink(c, data, len) == 0 ? len : -1;
+    }
+    if (amf3_serialize_context_reserve(c, len) != 0) {
+	c->failed = 1;
+	return -1;
     }
     memcpy(c->buffer + c->length, data, len);
     c->length += len;
@@ -1227,7 +4397,72 @@ int amf3_serialize_write_func(AMF3SerializeContext c, const void *data, int len)
 const char *amf3_serialize_context_get_buffer(AMF3SerializeContext c, int *len) {
     if (len)
 	*len = c->length;
-    return c->buffer;
+    return c->failed ? NULL : c->buffer;
+}
+
+static int amf3__serialize_segment(AMF3SerializeContext c,
+	const char *data, int offset, int length) {
+    if (c->nsegment == c->segment_alloc) {
+	int n = c->segment_alloc ? c->segment_alloc << 1 : 16;
+	struct amf3_segment *s = realloc(c->segments, n * sizeof(*s));
+	if (!s)
+	    return -1;
+	c->segments = s;
+	c->segment_alloc = n;
+    }
+    c->segments[c->nsegment].data = data;
+    c->segments[c->nsegment].offset = offset;
+    c->segments[c->nsegment].length = length;
+    c->nsegment++;
+    return 0;
+}
+
+/* ends the segment of buffered bytes not yet in the output. */
+static int amf3__serialize_segment_close(AMF3SerializeContext c) {
+    if (c->length == c->segmented)
+	return 0;
+    if (amf3__serialize_segment(c, NULL, c->segmented,
+		c->length - c->segmented) != 0)
+	return -1;
+    c->segmented = c->length;
+    return 0;
+}
+
+int amf3_serialize_write_payload(AMF3SerializeContext c,
+	const void *data, int len) {
+    if (!(c->flags & AMF3_SERIALIZE_IOVEC) || len < AMF3_SERIALIZE_IOVEC_MIN ||
+	    c->flags & AMF3_SERIALIZE_MEASURE)
+	return amf3_serialize_write_func(c, data, len);
+    if (c->failed)
+	return -1;
+    if (amf3__serialize_segment_close(c) != 0 ||
+	    amf3__serialize_segment(c, data, 0, len) != 0) {
+	c->failed = 1;
+	return -1;
+    }
+    return len;
+}
+
+const struct iovec *amf3_serialize_context_get_iovec(AMF3SerializeContext c,
+	int *niov) {
+    assert(c->flags & AMF3_SERIALIZE_IOVEC);
+    if (c->failed || amf3__serialize_segment_close(c) != 0)
+	return NULL;
+    // the buffer may have moved since, so resolve offsets only now
+    struct iovec *iov = realloc(c->iov,
+	    (c->nsegment ? c->nsegment : 1) * sizeof(struct iovec));
+    if (!iov)
+	return NULL;
+    c->iov = iov;
+    int i;
+    for (i = 0; i < c->nsegment; i++) {
+	struct amf3_segment *s = &c->segments[i];
+	iov[i].iov_base = (void *)(s->data ? s->data : c->buffer + s->offset);
+	iov[i].iov_len = s->length;
+    }
+    if (niov)
+	*niov = c->nsegment;
+    return iov;
 }
 
 int amf3_serialize_u29(AMF3SerializeContext c, int integer) {
@@ -1284,37 +4519,35 @@ static int amf3__serialize_string(AMF3SerializeContext c, AMF3Value v) {
 	amf3_ref_table_push(c->string_refs, v);
     else
 	return amf3__serialize_object_ref(c, refidx);
-    LOG(LOG_DEBUG, "string_ref[%d] = \"%s\"\n",
-	    c->string_refs->nref - 1, amf3_string_cstr(v));
+    LOG(LOG_DEBUG, "string_ref[%d] = \"%.*s\"\n",
+	    c->string_refs->nref - 1, STRARG(v));
 
     int wrote = amf3_serialize_u29(c, (amf3_string_len(v) << 1) | 1);
-    wrote += amf3_serialize_write_func(c, amf3_string_cstr(v),
+    wrote += amf3_serialize_write_payload(c, amf3_string_cstr(v),
 	    amf3_string_len(v));
     return wrote;
 }
 
-static void *amf3__serialize_kv_cb(
-	List list, int idx, void *INLIST, void *c) {
-    struct amf3_kv *inlist = (struct amf3_kv *)INLIST;
-    amf3__serialize_string((AMF3SerializeContext)c, inlist->key);
-    amf3_serialize_value((AMF3SerializeContext)c, inlist->value);
-    return NULL;
-}
-
-static void *amf3__serialize_v_cb(
-	List list, int idx, void *elem, void *c) {
-    amf3_serialize_value((AMF3SerializeContext)c, (AMF3Value)elem);
-    return NULL;
+static int amf3__serialize_kvmap(AMF3SerializeContext c, struct amf3_kvmap *m) {
+    int wrote = 0;
+    int i;
+    for (i = 0; i < m->count; i++) {
+	wrote += amf3__serialize_string(c, m->entries[i].key);
+	wrote += amf3_serialize_value(c, m->entries[i].value);
+    }
+    return wrote;
 }
 
 static int amf3__serialize_array(AMF3SerializeContext c, AMF3Value v) {
     assert(v->type == AMF3_ARRAY);
-    int currlen = c->length;
-    amf3_serialize_u29(c, (list_count(v->v.array.dense_list) << 1) | 1);
-    list_foreach(v->v.array.assoc_list, amf3__serialize_kv_cb, c);
-    amf3_serialize_u29(c, 0x01);
-    list_foreach(v->v.array.dense_list, amf3__serialize_v_cb, c);
-    return c->length - currlen;
+    // not c->length, which flushes to a sink reset
+    int wrote = amf3_serialize_u29(c, (v->v.array.ndense << 1) | 1);
+    wrote += amf3__serialize_kvmap(c, v->v.array.assoc);
+    wrote += amf3_serialize_u29(c, 0x01);
+    int i;
+    for (i = 0; i < v->v.array.ndense; i++)
+	wrote += amf3_serialize_value(c, v->v.array.dense[i]);
+    return wrote;
 }
 
 static int amf3__serialize_object(AMF3SerializeContext c, AMF3Value v) {
@@ -1341,32 +4574,34 @@ static int amf3__serialize_object(AMF3SerializeContext c, AMF3Value v) {
 	    wrote += amf3__serialize_string(c, t->members[i]);
 
 	amf3_ref_table_push(c->traits_refs, traits);
-	LOG(LOG_DEBUG, "traits_ref[%d] = type:%s\n",
-		c->traits_refs->nref - 1, amf3_string_cstr(t->type));
+	LOG(LOG_DEBUG, "traits_ref[%d] = type:%.*s\n",
+		c->traits_refs->nref - 1, STRARG(t->type));
     }
 
     if (t->externalizable) {
 	const struct amf3_plugin_parser *pp =
-	    amf3__find_plugin_parser(t->type);
+	    amf3__traits_plugin(traits);
 	if (pp)
 	    wrote += pp->serializefunc(c, t->type, v->v.object.m.external_ctx);
 	else
-	    LOG(LOG_ERROR, "%s: external serializer of type '%s' returns error\n",
-		    __func__, amf3_string_cstr(t->type));
+	    LOG(LOG_ERROR, "%s: external serializer of type '%.*s' returns error\n",
+		    __func__, STRARG(t->type));
     } else {
 	int i;
 	for (i = 0; i < t->nmemb; i++)
 	    wrote += amf3_serialize_value(c, v->v.object.m.i.member_values[i]);
 
 	if (t->dynamic) {
-	    list_foreach(v->v.object.m.i.dynmemb_list, amf3__serialize_kv_cb, c);
-	    amf3_serialize_u29(c, 0x01);
+	    wrote += amf3__serialize_kvmap(c, v->v.object.m.i.dynmemb);
+	    wrote += amf3_serialize_u29(c, 0x01);
 	}
     }
     return wrote;
 }
 
 int amf3_serialize_value(AMF3SerializeContext c, AMF3Value v) {
+    if (!amf3__force(v))
+	return -1;
     char mark = v->type;
 
     int wrote = amf3_serialize_write_func(c, &mark, sizeof(mark));
@@ -1419,7 +4654,7 @@ int amf3_serialize_value(AMF3SerializeContext c, AMF3Value v) {
 	case AMF3_XML:
 	case AMF3_BYTEARRAY:
 	    wrote += amf3_serialize_u29(c, (v->v.binary.length << 1) | 1);
-	    wrote += amf3_serialize_write_func(c, v->v.binary.data,
+	    wrote += amf3_serialize_write_payload(c, v->v.binary.data,
 		    v->v.binary.length);
 	    break;
 
@@ -1443,3 +4678,13 @@ int amf3_serialize_value(AMF3SerializeContext c, AMF3Value v) {
 
     return wrote;
 }
+
+int amf3_serialize_measure(AMF3Value v) {
+    AMF3SerializeContext c = amf3__serialize_context_new(
+	    AMF3_SERIALIZE_MEASURE, NULL, 0);
+    if (!c)
+	return -1;
+    int length = amf3_serialize_value(c, v) < 0 ? -1 : c->length;
+    amf3_serialize_context_free(c);
+    return length;
+}
@@ -2,8 +2,9 @@
 #   define _AMF3_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "endian.h"
-#include "list.h"
+#include "arena.h"
 
 #define AMF3_UNDEFINED	(0x00)
 #define AMF3_NULL	(0x01)
@@ -22,18 +23,60 @@
 /* types for internal use */
 #define AMF3_TRAITS	(0x70)
 
+/* amf3_value flags */
+#define AMF3_VALUE_ARENA    (0x01)  /* owned by an arena, never refcounted */
+#define AMF3_VALUE_BORROWED (0x02)  /* binary data points into parse input */
+#define AMF3_VALUE_MARK	    (0x04)  /* transient, set while walking a graph */
+#define AMF3_VALUE_IMMORTAL (0x08)  /* statically allocated, never freed */
+#define AMF3_VALUE_INTERNED (0x10)  /* unique string from `amf3_intern' */
+#define AMF3_VALUE_LAZY	    (0x20)  /* array or object not decoded yet */
+#define AMF3_VALUE_FROZEN   (0x40)  /* immutable, refcounted atomically */
+
+/* integers in this range are shared immortal values */
+#define AMF3_SMALLINT_MIN   (-128)
+#define AMF3_SMALLINT_MAX   (1023)
+
+/* amf3_parse_context flags */
+#define AMF3_PARSE_ARENA    (0x01)  /* allocate values from a context arena */
+#define AMF3_PARSE_BORROW   (0x02)  /* strings and binaries view the input */
+#define AMF3_PARSE_INTERN   (0x04)  /* class, member and key names interned */
+#define AMF3_PARSE_LAZY	    (0x08)  /* decode nested containers on access */
+
+/* amf3_serialize_context flags */
+#define AMF3_SERIALIZE_MEASURE	(0x01)	/* count the bytes, write nothing */
+#define AMF3_SERIALIZE_FIXED	(0x02)	/* the buffer is the caller's */
+#define AMF3_SERIALIZE_IOVEC	(0x04)	/* reference large payloads */
+#define AMF3_SERIALIZE_SINK	(0x08)	/* stage output for a sink */
+
+/* payloads this long or longer are not copied with AMF3_SERIALIZE_IOVEC */
+#define AMF3_SERIALIZE_IOVEC_MIN (512)
+
+/* strings longer than this, or past this many entries, are not interned */
+#define AMF3_INTERN_MAX_LENGTH	(256)
+#define AMF3_INTERN_MAX_ENTRIES	(65536)
+
+/* why a batch item failed, in its `error' */
+#define AMF3_ITEM_OK	    (0)
+#define AMF3_ITEM_NOMEM	    (1)  /* out of memory */
+#define AMF3_ITEM_TRUNCATED (2)  /* the input ends before the value does */
+#define AMF3_ITEM_MALFORMED (3)  /* not a value, or one no plugin can read */
+#define AMF3_ITEM_FAILED    (4)  /* refused by a plugin, or out of memory */
+
 
 struct amf3_value;
-struct amf3_vlist;
-struct amf3_kvlist;
+struct amf3_visit_context;
+struct amf3_visit_resume;
+struct amf3_kvmap;
 
 struct amf3_date {
     double value;
 };
 
 struct amf3_array {
-    List assoc_list;
-    List dense_list;
+    struct amf3_kvmap *assoc;
+    struct amf3_value **dense;
+    int ndense;
+    int dense_alloc;
 };
 
 struct amf3_traits {
@@ -42,6 +85,10 @@ struct amf3_traits {
     char dynamic;
     int nmemb;
     struct amf3_value **members;
+    unsigned int hash;	/* identity hash, 0 until computed */
+    /* plugin of an externalizable class, resolved on creation; NULL if the
+     * class was not registered yet */
+    const struct amf3_plugin_parser *plugin;
 };
 
 struct amf3_object {
@@ -49,7 +96,7 @@ struct amf3_object {
     union {
 	struct {
 	    struct amf3_value **member_values;
-	    List dynmemb_list;
+	    struct amf3_kvmap *dynmemb;
 	} i;
 	void *external_ctx;
     } m;
@@ -60,9 +107,20 @@ struct amf3_binary {
     char *data;
 };
 
+/* where to decode a lazy array or object from */
+struct amf3_lazy {
+    struct amf3_parse_context *c;
+    int offset;			/* of its marker in the input */
+    /* sizes of the reference tables when it starts */
+    int nobject;
+    int nstring;
+    int ntraits;
+};
+
 struct amf3_value {
     int retain_count;
     char type;
+    char flags;
     union {
 	int			integer;
 	double			real;
@@ -73,12 +131,26 @@ struct amf3_value {
 
 	/* for internal use only */
 	struct amf3_traits	traits;
+	struct amf3_lazy	lazy;
     } v;
 };
 
 struct amf3_kv {
     struct amf3_value *key;
     struct amf3_value *value;
+    unsigned int hash;
+};
+
+/* insertion-ordered string map; scanned while small, hashed beyond
+ * AMF3_KVMAP_LINEAR_MAX entries. */
+#define AMF3_KVMAP_LINEAR_MAX (8)
+struct amf3_kvmap {
+    struct amf3_kv *entries;
+    int count;
+    int nalloc;
+    int *slots;		/* entry index + 1; 0 if empty */
+    int nslot;		/* power of 2 */
+    Arena arena;
 };
 
 struct amf3_valfind {
@@ -91,6 +163,12 @@ struct amf3_ref_table {
     struct amf3_value **refs;
     int nref;
     int nalloc;
+    /* optional hash index, see `amf3_ref_table_new_indexed' */
+    unsigned int *hashes;	/* parallel to `refs' */
+    int *slots;			/* open addressing, ref index + 1; 0 if empty */
+    int nslot;			/* power of 2 */
+    /* frozen values are held without a reference, see `amf3_freeze' */
+    char borrow_frozen;
 };
 
 struct amf3_parse_context {
@@ -101,8 +179,33 @@ struct amf3_parse_context {
     struct amf3_ref_table *object_refs;
     struct amf3_ref_table *string_refs;
     struct amf3_ref_table *traits_refs;
+    int flags;
+    Arena arena;
+    /* set when a read ran past the end of input; parsers return an error
+     * then, which a push parser retries once more data arrives */
+    int starved;
+    /* AMF3_PARSE_LAZY, and push parsers ahead of external objects:
+     * reference tables of the skip pass, in step with ours; and the lazy
+     * value being decoded */
+    struct amf3_visit_context *shadow;
+    struct amf3_value *adopt;
+    int depth;			/* of arrays and objects being decoded */
 };
 
+/* a piece of serializer output: `length' bytes at `data', or at `offset'
+ * in the context buffer if `data' is NULL */
+struct amf3_segment {
+    const char *data;
+    int offset;
+    int length;
+};
+
+/* takes up to `len' bytes of serializer output.  returns how many it took;
+ * taking fewer is backpressure, and the rest is offered again at once, so
+ * a sink that cannot take anything should block until it can.  A negative
+ * return fails the serialization. */
+typedef int (* AMF3SerializeSinkFunc) (void *ctx, const void *data, int len);
+
 struct amf3_serialize_context {
     char *buffer;
     int allocated;
@@ -110,11 +213,185 @@ struct amf3_serialize_context {
     struct amf3_ref_table *object_refs;
     struct amf3_ref_table *string_refs;
     struct amf3_ref_table *traits_refs;
+    int flags;
+    int failed;			/* set when a write did not fit */
+    /* AMF3_SERIALIZE_IOVEC: the output so far, in order */
+    struct amf3_segment *segments;
+    int nsegment;
+    int segment_alloc;
+    int segmented;		/* bytes of the buffer already in segments */
+    struct iovec *iov;
+    /* AMF3_SERIALIZE_SINK: where the buffer is flushed to when full */
+    AMF3SerializeSinkFunc sink;
+    void *sink_ctx;
+    int64_t flushed;		/* bytes taken by the sink so far */
+};
+
+/* an array or object of a push parser still waiting for its contents */
+struct amf3_push_frame {
+    struct amf3_value *container;
+    struct amf3_value *key;	/* assoc or dynamic key awaiting its value */
+    int idx;			/* next dense element or sealed member */
+    int len;			/* dense length of an array */
+    char state;
+};
+
+struct amf3_push_parser {
+    struct amf3_parse_context *c;
+    /* unconsumed input, i.e. the start of an incomplete token */
+    char *buffer;
+    int buffered;
+    int allocated;
+    struct amf3_push_frame *frames;
+    int nframe;
+    int frame_alloc;
+    struct amf3_value *result;
+    int status;
+};
+
+/* amf3_push_parser_feed results */
+#define AMF3_PUSH_MORE	    (0)
+#define AMF3_PUSH_DONE	    (1)
+#define AMF3_PUSH_ERROR	    (-1)
+
+/* a string inside the input of a visit */
+struct amf3_strview {
+    const char *data;
+    int length;
+};
+
+struct amf3_visit_traits {
+    struct amf3_strview classname;
+    char externalizable;
+    char dynamic;
+    int nmemb;
+    int members;		/* first member name in amf3_visit_context.names */
+};
+
+/* Callbacks of `amf3_visit_value'; any of them may be NULL.  A non-zero
+ * return stops the visit, which then fails.  Strings and binaries are
+ * views into the input, valid as long as it is. */
+struct amf3_visitor {
+    /* undefined, null, false and true */
+    int (*atom)(void *ctx, char type);
+    int (*integer)(void *ctx, int value);
+    int (*real)(void *ctx, double value);
+    int (*date)(void *ctx, double value);
+    int (*string)(void *ctx, const char *data, int length);
+    /* XML, XML document or ByteArray */
+    int (*binary)(void *ctx, char type, const char *data, int length);
+    /* to the `idx'th array, object, date, XML or ByteArray of the input,
+     * whose marker is at byte `offset' */
+    int (*reference)(void *ctx, int idx, int offset);
+    /* the associative part comes first as `key' and value pairs, then
+     * `dense_length' values */
+    int (*start_array)(void *ctx, int dense_length);
+    /* sealed members come as `member' and value pairs, dynamic members and
+     * fields of externalizable objects as `key' and value pairs */
+    int (*start_object)(void *ctx, const struct amf3_visit_traits *traits,
+	    const struct amf3_strview *member_names);
+    int (*member)(void *ctx, int idx, const char *name, int length);
+    int (*key)(void *ctx, const char *name, int length);
+    /* closes the innermost array or object */
+    int (*end)(void *ctx);
+};
+
+/* entries of each visit reference table kept inside the context, so that
+ * most values are walked without allocating */
+#define AMF3_VISIT_INLINE   (32)
+
+/* arrays and objects nested deeper than this are rejected as malformed,
+ * which bounds the recursion of the parser and the visitor */
+#define AMF3_MAX_DEPTH	    (1024)
+
+/* amf3_visit_context flags */
+#define AMF3_VISIT_CHECK_UTF8	(0x01)	/* fail on strings not in UTF-8 */
+
+struct amf3_visit_context {
+    const char *data;
+    int length;
+    const char *p;
+    int left;
+    int starved;
+    int flags;
+    int depth;			/* of arrays and objects being visited */
+    struct amf3_visit_resume *resume;	/* where a skip ran out of input */
+    const struct amf3_visitor *visitor;
+    void *ctx;
+    /* reference tables, holding views and offsets instead of values;
+     * offsets and member names are only kept for visitors that use them */
+    struct amf3_strview *strings;
+    int nstring;
+    int string_alloc;
+    int *objects;		/* offset of each complex value */
+    int nobject;
+    int object_alloc;
+    struct amf3_visit_traits *traits;
+    int ntraits;
+    int traits_alloc;
+    struct amf3_strview *names;	/* member names of all traits */
+    int nname;
+    int name_alloc;
+    struct amf3_strview string_inline[AMF3_VISIT_INLINE];
+    int object_inline[AMF3_VISIT_INLINE];
+    struct amf3_visit_traits traits_inline[AMF3_VISIT_INLINE];
+    struct amf3_strview name_inline[AMF3_VISIT_INLINE];
+};
+
+/* a property lookup resolved once per traits, see `amf3_accessor_init' */
+struct amf3_accessor {
+    struct amf3_value *classname;
+    struct amf3_value *key;
+    struct amf3_value *traits;	/* last traits seen, retained */
+    unsigned int traits_hash;
+    int slot;			/* see AMF3_ACCESSOR_* */
+};
+
+/* values of amf3_accessor.slot other than sealed member indices */
+#define AMF3_ACCESSOR_NONE	(-1)	/* no such property for the traits */
+#define AMF3_ACCESSOR_DYNAMIC	(-2)	/* look up dynamic members */
+#define AMF3_ACCESSOR_GENERIC	(-3)	/* fall back to amf3_object_prop_get */
+
+/* a step of a compiled path, see `amf3_path_compile' */
+struct amf3_path_step {
+    int kind;			/* AMF3_PATH_* */
+    int index;			/* of AMF3_PATH_INDEX */
+    struct amf3_accessor acc;	/* of AMF3_PATH_KEY */
+};
+
+#define AMF3_PATH_KEY	(0)	/* a property, or an associative entry */
+#define AMF3_PATH_INDEX	(1)	/* a dense element */
+#define AMF3_PATH_EACH	(2)	/* each dense element */
+#define AMF3_PATH_ALL	(3)	/* each property, or associative entry */
+
+struct amf3_path {
+    int nstep;
+    struct amf3_path_step *steps;
+};
+
+/* an input of `amf3_parse_batch' and its result */
+struct amf3_parse_item {
+    const char *data;
+    int length;
+    struct amf3_value *value;	/* NULL if the input is invalid */
+    int error;			/* AMF3_ITEM_*, why `value' is NULL */
+};
+
+/* an input of `amf3_serialize_batch' and its result */
+struct amf3_serialize_item {
+    struct amf3_value *value;
+    char *data;			/* encoded, to free; NULL if it failed */
+    int length;
+    int error;			/* AMF3_ITEM_*, why `data' is NULL */
 };
 
 typedef struct amf3_value *AMF3Value;
 typedef struct amf3_parse_context *AMF3ParseContext;
 typedef struct amf3_serialize_context *AMF3SerializeContext;
+typedef struct amf3_push_parser *AMF3PushParser;
+typedef struct amf3_visit_context *AMF3VisitContext;
+typedef struct amf3_path *AMF3Path;
+typedef struct amf3_worker_pool *AMF3WorkerPool;
 /* returns 0 if success; otherwise, failed. */
 typedef int (* AMF3PluginParserParseFunc) (
 	AMF3ParseContext c, AMF3Value classname, void **external_ctx);
@@ -124,6 +401,25 @@ typedef int  (* AMF3PluginExternalObjectWriteFunc) (
 	AMF3SerializeContext c, const void *data, int len);
 typedef int  (* AMF3PluginExternalObjectSerializeFunc) (
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx);
+typedef void (* AMF3ValueIterFunc) (AMF3Value v, void *ctx);
+/* calls `func' on every value directly held by the external object. */
+typedef void (* AMF3PluginExternalObjectForeachFunc) (
+	void *external_ctx, AMF3ValueIterFunc func, void *ctx);
+/* visits the body of an external object, naming each field with
+ * `amf3_visit_key'.  returns 0 if success. */
+typedef int (* AMF3PluginExternalObjectVisitFunc) (
+	AMF3VisitContext c, const char *classname, int length);
+/* returns the field `name' of the external object, not retained, or NULL. */
+typedef AMF3Value (* AMF3PluginExternalObjectGetFunc) (
+	void *external_ctx, const char *name, int length);
+/* called on each match of a path; a non-zero return stops the query. */
+typedef int (* AMF3PathMatchFunc) (AMF3Value v, void *ctx);
+/* called on a worker once every item of a batch is parsed. */
+typedef void (* AMF3ParseBatchDoneFunc) (
+	struct amf3_parse_item *items, int n, int nfailed, void *ctx);
+/* called on a worker once every item of a batch is serialized. */
+typedef void (* AMF3SerializeBatchDoneFunc) (
+	struct amf3_serialize_item *items, int n, int nfailed, void *ctx);
 
 struct amf3_plugin_parser {
     char *classname;
@@ -131,10 +427,27 @@ struct amf3_plugin_parser {
     AMF3PluginExternalObjectFreeFunc freefunc;
     AMF3PluginExternalObjectDumpFunc dumpfunc;
     AMF3PluginExternalObjectSerializeFunc serializefunc;
+    AMF3PluginExternalObjectForeachFunc foreachfunc;
+    AMF3PluginExternalObjectVisitFunc visitfunc;
+    AMF3PluginExternalObjectGetFunc getfunc;
 };
 
+/* Registers an externalizable class besides the built-in ones; `pp' is
+ * copied.  Lookups take no lock, so this is safe while other threads are
+ * parsing.  handler, freefunc and serializefunc are required.  returns -1
+ * if the class is already registered or on failure. */
+int amf3_plugin_register(const struct amf3_plugin_parser *pp);
+/* returns the plugin handling `classname', or NULL. */
+const struct amf3_plugin_parser *amf3_plugin_find(const char *classname,
+	int length);
+
+/* refcounts are plain integers unless the library is built with
+ * AMF3_ATOMIC_REFCOUNT defined; values from `amf3_freeze' are always
+ * refcounted atomically and may be retained and released on any thread. */
 AMF3Value amf3_retain(AMF3Value v);
 void amf3_release(AMF3Value v);
+/* undefined, null, booleans and small integers are immortal singletons:
+ * compare them by type and value, not by pointer. */
 AMF3Value amf3_new_undefined();
 AMF3Value amf3_new_null();
 AMF3Value amf3_new_false();
@@ -152,14 +465,43 @@ AMF3Value amf3_new_object(AMF3Value type, char dynamic,
 	AMF3Value *member_names, int nmemb);
 AMF3Value amf3_new_object_external(AMF3Value type, void *external_ctx);
 
+/* Returns the process-wide shared string equal to `string', creating it on
+ * first use.  Interned strings are immortal and compare equal only to
+ * themselves, which turns name comparisons into pointer compares.  Falls
+ * back to a new ordinary string once the table is full or for long input.
+ * Thread-safe. */
+AMF3Value amf3_intern(const char *string, int length);
+/* same, for an existing string value; returns `v' itself if interned. */
+AMF3Value amf3_intern_value(AMF3Value v);
+
 int amf3_string_cmp(AMF3Value a, AMF3Value b);
 int amf3_string_len(AMF3Value v);
+/* not NUL-terminated if the string is a borrowed view (AMF3_PARSE_BORROW);
+ * always pair with `amf3_string_len'. */
 const char *amf3_string_cstr(AMF3Value v);
 
 int amf3_binary_len(AMF3Value v);
 const char *amf3_binary_data(AMF3Value v);
+/* returns a new heap-owned, NUL-terminated copy of a string, XML or
+ * ByteArray value. */
+AMF3Value amf3_binary_copy(AMF3Value v);
+/* copies every borrowed payload reachable from `v' so that the tree no longer
+ * refers to the parse input.  `arena' must be the arena owning `v' for
+ * arena-allocated trees, NULL otherwise.  returns 0 if success. */
+int amf3_pin(AMF3Value v, Arena arena);
+/* makes every value reachable from `v' immutable so that the tree can be
+ * read from several threads at once.  lazy containers are decoded and
+ * traits hashes computed up front; borrowed payloads still refer to the
+ * parse input, see `amf3_pin'.  serialize contexts do not retain frozen
+ * values, so the tree must outlive their reference tables, and must not be
+ * frozen while one still refers to it.  returns 0 if success; on failure
+ * part of the tree may be frozen. */
+int amf3_freeze(AMF3Value v);
 
 void amf3_array_push(AMF3Value a, AMF3Value v);
+/* dense part */
+int amf3_array_len(AMF3Value a);
+AMF3Value amf3_array_get(AMF3Value a, int idx);
 void amf3_array_assoc_set(AMF3Value a, AMF3Value key, AMF3Value value);
 AMF3Value amf3_array_assoc_get(AMF3Value a, AMF3Value key);
 
@@ -168,6 +510,17 @@ void *amf3_object_external_get(AMF3Value o);
 AMF3Value amf3_object_prop_get(AMF3Value o, AMF3Value key);
 void amf3_object_prop_set(AMF3Value o, AMF3Value key, AMF3Value value);
 
+/* Accessors cache the sealed member slot of `key' for the last traits they
+ * met, so repeated reads from objects of one class cost a pointer compare
+ * and an array index.  Traits equal to the cached ones (same class, flags
+ * and member names) reuse the slot without searching.  If `classname' is
+ * given, objects of any other class read as NULL.  An accessor keeps the
+ * traits it cached alive; clean it up before freeing an arena it has seen. */
+void amf3_accessor_init(struct amf3_accessor *acc,
+	AMF3Value classname, AMF3Value key);
+void amf3_accessor_cleanup(struct amf3_accessor *acc);
+AMF3Value amf3_accessor_get(struct amf3_accessor *acc, AMF3Value o);
+
 AMF3Value amf3_traits_type_get(AMF3Value o);
 int amf3_traits_is_externalizable(AMF3Value o);
 int amf3_traits_is_dynamic(AMF3Value o);
@@ -175,9 +528,17 @@ int amf3_traits_num_members(AMF3Value o);
 AMF3Value amf3_traits_member_name_get(AMF3Value o, int idx);
 
 struct amf3_ref_table *amf3_ref_table_new();
+/* a table that also keeps a hash index over its values, making
+ * `amf3_ref_table_find' O(1) for the types it can hash. */
+struct amf3_ref_table *amf3_ref_table_new_indexed();
 void amf3_ref_table_free(struct amf3_ref_table *r);
+/* releases every value, keeping the capacity. */
+void amf3_ref_table_reset(struct amf3_ref_table *r);
 AMF3Value amf3_ref_table_push(struct amf3_ref_table *r, AMF3Value v);
 AMF3Value amf3_ref_table_get(struct amf3_ref_table *r, int idx);
+/* returns the index of a value equal to `v' (as AMF3 references compare
+ * them), or -1 if not found. */
+int amf3_ref_table_find(struct amf3_ref_table *r, AMF3Value v);
 
 int amf3_parse_u29(struct amf3_parse_context *c);
 AMF3Value amf3_parse_string(struct amf3_parse_context *c);
@@ -186,16 +547,186 @@ AMF3Value amf3_parse_object(struct amf3_parse_context *c);
 AMF3Value amf3_parse_value(struct amf3_parse_context *c);
 
 AMF3ParseContext amf3_parse_context_new(const char *data, int length);
+/* With AMF3_PARSE_ARENA, every value, payload, map, dense vector and
+ * traits member array is carved from an arena owned by the context and
+ * released in one shot with it; `amf3_retain' and `amf3_release' are
+ * no-ops on such values.  Containers owned by an arena never release what
+ * they hold, so only store arena-owned (or otherwise long-lived) values
+ * into them. */
+AMF3ParseContext amf3_parse_context_new_ex(const char *data, int length,
+	int flags);
+/* AMF3_PARSE_LAZY implies AMF3_PARSE_ARENA and AMF3_PARSE_BORROW.  Arrays
+ * and objects below the top-level value are only skipped over, and are
+ * decoded in place the first time their contents are used, through any of
+ * the accessors, serialization or dump.  Their type is known beforehand.
+ * Lazy values decode from the context and its input, so both must outlive
+ * them; the arena cannot be detached. */
 void amf3_parse_context_free(AMF3ParseContext c);
+/* Takes the arena away from the context so that the parsed values outlive
+ * it; release them with `arena_free'.  Later parses on `c' allocate from
+ * the heap, and cannot refer back to values parsed before. */
+Arena amf3_parse_context_detach_arena(AMF3ParseContext c);
+/* Starts over on new input, keeping the flags and the capacity of the
+ * reference tables and the arena.  Values parsed from the arena before are
+ * freed. */
+void amf3_parse_context_reset(AMF3ParseContext c, const char *data, int length);
+
+/* Each thread keeps up to AMF3_CONTEXT_POOL_SIZE released contexts of each
+ * kind to hand out again after a reset, so that steady request handling
+ * allocates none.  Acquire as with `amf3_parse_context_new_ex' or
+ * `amf3_serialize_context_new'; release instead of freeing. */
+#define AMF3_CONTEXT_POOL_SIZE	(4)
+/* serialize contexts whose buffer grew past this are freed, not pooled */
+#define AMF3_CONTEXT_POOL_MAX_BUFFER (1 << 20)
+AMF3ParseContext amf3_parse_context_acquire(const char *data, int length,
+	int flags);
+void amf3_parse_context_release(AMF3ParseContext c);
+AMF3SerializeContext amf3_serialize_context_acquire();
+void amf3_serialize_context_release(AMF3SerializeContext c);
+/* frees the contexts pooled by the calling thread; done at thread exit. */
+void amf3_context_pool_clear();
+
+/* A worker pool runs batches on its threads, each thread starting with an
+ * even share of the items and stealing from the others once it is out.
+ * Workers parse and serialize with contexts from their own pool, see
+ * `amf3_parse_context_acquire'.  `nthread' <= 0 starts one per CPU. */
+AMF3WorkerPool amf3_worker_pool_new(int nthread);
+/* finishes the queued batches, then stops the workers. */
+void amf3_worker_pool_free(AMF3WorkerPool pool);
+/* Parses a value from each item into its `value', using a fresh context
+ * with `flags'; AMF3_PARSE_ARENA and AMF3_PARSE_LAZY are refused since
+ * their values would not outlive it.  With `done', returns at once and
+ * calls it when finished; the items must stay alive until then.  Without,
+ * returns when finished, and must not be called from a worker.  returns -1
+ * if the batch could not be started.  An item that fails gets a NULL
+ * `value' and tells why in its `error'. */
+int amf3_parse_batch(AMF3WorkerPool pool, struct amf3_parse_item *items,
+	int n, int flags, AMF3ParseBatchDoneFunc done, void *ctx);
+/* Serializes each item's `value' into its `data', with reference tables of
+ * its own, so the output does not depend on which worker wrote it.  Values
+ * reachable from more than one item are read by several threads at once
+ * and must be frozen, see `amf3_freeze'.  `done' is as for
+ * `amf3_parse_batch'.  An item that fails gets a NULL `data' and tells
+ * why in its `error'. */
+int amf3_serialize_batch(AMF3WorkerPool pool,
+	struct amf3_serialize_item *items, int n,
+	AMF3SerializeBatchDoneFunc done, void *ctx);
+/* Same, but returns the encodings back to back in one buffer: value `i' is
+ * at `(*offsets)[i]' up to `(*offsets)[i + 1]'.  The values are measured
+ * first, then each is written straight into its place.  Free both the
+ * buffer and the `n' + 1 offsets.  returns NULL if any value failed. */
+char *amf3_serialize_batch_concat(AMF3WorkerPool pool, AMF3Value *values,
+	int n, int **offsets, int *length);
+
+/* A push parser builds one value from input arriving in chunks of any size,
+ * keeping its partial tree and reference tables between them.  Only the
+ * bytes of an incomplete token (a U29, a string, a traits header) are kept
+ * across calls; externalizable objects are handed to their plugin once all
+ * of their bytes are in, which its visitfunc tells without starting over
+ * on each chunk (plugins without one are retried instead).  `flags' are
+ * those of a parse context, except that AMF3_PARSE_BORROW is ignored since
+ * chunks do not outlive the call. */
+AMF3PushParser amf3_push_parser_new(int flags);
+void amf3_push_parser_free(AMF3PushParser p);
+/* Returns AMF3_PUSH_MORE when all of `data' was taken and the value is not
+ * complete yet, AMF3_PUSH_DONE when it is, in which case `*consumed' (if
+ * not NULL) tells how many bytes of `data' it took, or AMF3_PUSH_ERROR on
+ * malformed input.  Once done or failed, further calls just repeat that. */
+int amf3_push_parser_feed(AMF3PushParser p, const char *data, int length,
+	int *consumed);
+/* hands the parsed value over to the caller, NULL if not done. */
+AMF3Value amf3_push_parser_take(AMF3PushParser p);
+/* see `amf3_parse_context_detach_arena'.  Take the value first: one not
+ * taken yet is dropped, and a value only partly parsed fails the parser. */
+Arena amf3_push_parser_detach_arena(AMF3PushParser p);
+
+/* The visitor API decodes the same input as `amf3_parse_value' without
+ * building values: each is reported to `visitor' as it is read, and
+ * references resolve to indices and input offsets. */
+AMF3VisitContext amf3_visit_context_new(const char *data, int length,
+	const struct amf3_visitor *visitor, void *ctx);
+void amf3_visit_context_free(AMF3VisitContext c);
+/* visits one value. returns 0 if success. */
+int amf3_visit_value(AMF3VisitContext c);
+/* walks one value without reporting it. returns 0 if success. */
+int amf3_visit_skip(AMF3VisitContext c);
+/* reports the name of the next field of an external object. */
+int amf3_visit_key(AMF3VisitContext c, const char *name, int length);
+
+/* Returns the encoded length of the value at the start of `data', 0 if the
+ * input ends before the value does, or -1 if it is malformed.  Nothing is
+ * allocated unless the value holds more than AMF3_VISIT_INLINE distinct
+ * strings or traits. */
+int amf3_skip_value(const char *data, int length);
+/* returns 0 if `data' is exactly one well-formed value, with all strings
+ * in valid UTF-8; -1 otherwise.  Both treat arrays and objects nested more
+ * than AMF3_MAX_DEPTH deep as malformed. */
+int amf3_validate_value(const char *data, int length);
+
+/* Paths select values by property names and array indices, as in
+ * `body.rows[*].id' or `headers.DSId'.  `name' (or `.name') reads a property
+ * of an object, external ones through their plugin, or an associative entry
+ * of an array; `[n]' reads a dense element, `[*]' each dense element and
+ * `*' each property or associative entry.  Returns NULL if `expr' is
+ * malformed.  A path caches lookups, so use it from one thread at a time. */
+AMF3Path amf3_path_compile(const char *expr);
+void amf3_path_free(AMF3Path path);
+/* calls `func' on each value that `path' selects from `v'.  returns the
+ * number of matches, or -1 if a lazy value failed to decode. */
+int amf3_path_eval(AMF3Path path, AMF3Value v,
+	AMF3PathMatchFunc func, void *ctx);
+/* same, over an encoded value: it is parsed with AMF3_PARSE_LAZY added to
+ * `flags', so that only arrays and objects along the path are decoded.
+ * Matches live until `func' returns. */
+int amf3_path_query(AMF3Path path, const char *data, int length, int flags,
+	AMF3PathMatchFunc func, void *ctx);
 
 void amf3_dump_value(AMF3Value v, int depth);
 void amf3__print_indent(int indent);
 
 AMF3SerializeContext amf3_serialize_context_new();
+/* serializes into `buffer' of `size' bytes, which is never grown or freed;
+ * once a value does not fit, the context has failed. */
+AMF3SerializeContext amf3_serialize_context_new_buffer(char *buffer, int size);
+/* takes AMF3_SERIALIZE_* flags. */
+AMF3SerializeContext amf3_serialize_context_new_ex(int flags);
+/* Streams output to `sink' through a buffer of `size' bytes (64K if 0),
+ * flushed whenever a write would overflow it; writes longer than the
+ * buffer go to the sink directly.  Memory use does not grow with the
+ * output, only with the reference tables.  Flush after the last value. */
+AMF3SerializeContext amf3_serialize_context_new_sink(
+	AMF3SerializeSinkFunc sink, void *ctx, int size);
+/* hands the buffered output to the sink. returns 0 if success. */
+int amf3_serialize_context_flush(AMF3SerializeContext c);
 void amf3_serialize_context_free(AMF3SerializeContext c);
+/* Starts over with empty reference tables and output, keeping the buffer.
+ * Output not yet flushed to a sink is dropped. */
+void amf3_serialize_context_reset(AMF3SerializeContext c);
+/* makes room for `size' more bytes at once. returns 0 if success, or -1 if
+ * the buffer cannot hold them: one of the caller's, or a sink's even once
+ * flushed. */
+int amf3_serialize_context_reserve(AMF3SerializeContext c, int size);
+/* returns NULL if a write failed. */
 const char *amf3_serialize_context_get_buffer(AMF3SerializeContext c, int *len);
+/* With AMF3_SERIALIZE_IOVEC, the output is the buffer interleaved with
+ * payloads of strings, XML and byte arrays of AMF3_SERIALIZE_IOVEC_MIN
+ * bytes or more, which are referenced where they are instead of copied;
+ * the values must stay alive until the output is written.  Returns it as
+ * `*niov' entries for `writev' or `sendmsg', valid until the next write;
+ * NULL if a write failed. */
+const struct iovec *amf3_serialize_context_get_iovec(AMF3SerializeContext c,
+	int *niov);
 int amf3_serialize_write_func(AMF3SerializeContext c, const void *data, int len);
+/* same, but referenced instead of copied in AMF3_SERIALIZE_IOVEC mode if
+ * long enough. */
+int amf3_serialize_write_payload(AMF3SerializeContext c,
+	const void *data, int len);
 int amf3_serialize_u29(AMF3SerializeContext c, int integer);
 int amf3_serialize_value(AMF3SerializeContext c, AMF3Value v);
+/* Returns the exact encoded length of `v', references included, by running
+ * the serializer without writing.  Reserve that much, or size a buffer for
+ * `amf3_serialize_context_new_buffer' with it, to serialize with a single
+ * allocation.  returns -1 on error. */
+int amf3_serialize_measure(AMF3Value v);
 
 #endif
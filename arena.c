@@ -0,0 +1,169 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN (sizeof(long double) > 8 ? 16 : 8)
+#define ARENA_ROUNDUP(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUNDUP(sizeof(struct arena_block))
+
+Arena arena_new(size_t block_size) {
+    Arena a = malloc(sizeof(struct arena));
+    if (a) {
+	memset(a, 0, sizeof(*a));
+	a->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+    }
+    return a;
+}
+
+static void arena__run_cleanups(Arena a) {
+    struct arena_cleanup *cl = a->cleanups;
+    while (cl) {
+	cl->func(cl->ctx);
+	cl = cl->next;
+    }
+    a->cleanups = NULL;
+}
+
+static void arena__free_blocks(struct arena_block *b) {
+    while (b) {
+	struct arena_block *t = b;
+	b = b->next;
+	free(t);
+    }
+}
+
+void arena_free(Arena a) {
+    arena__run_cleanups(a);
+    arena__free_blocks(a->head);
+    arena__free_blocks(a->spare);
+    free(a);
+}
+
+/* releases blocks from `b' up to `end', keeping regular-sized ones. */
+static void arena__drop_blocks(Arena a, struct arena_block *b,
+	struct arena_block *end) {
+    while (b != end) {
+	struct arena_block *t = b;
+	b = b->next;
+	if (t->size == a->block_size) {
+	    t->next = a->spare;
+	    a->spare = t;
+	} else
+	    free(t);
+    }
+}
+
+void arena_reset(Arena a) {
+    arena__run_cleanups(a);
+    arena__drop_blocks(a, a->head, NULL);
+    a->head = NULL;
+}
+
+static struct arena_block *arena__new_block(size_t size) {
+    struct arena_block *b = malloc(ARENA_HEADER + size);
+    if (b) {
+	b->size = size;
+	b->used = 0;
+    }
+    return b;
+}
+
+void *arena_alloc(Arena a, size_t size) {
+    struct arena_block *b = a->head;
+    size = ARENA_ROUNDUP(size ? size : 1);
+    if (b && b->size - b->used >= size) {
+	void *p = (char *)b + ARENA_HEADER + b->used;
+	b->used += size;
+	return p;
+    }
+
+    if (size > a->block_size / 4) {
+	// large requests get a block of their own, placed behind the
+	// current block so that its free space is not wasted.
+	struct arena_block *big = arena__new_block(size);
+	if (!big)
+	    return NULL;
+	big->used = size;
+	if (b) {
+	    big->next = b->next;
+	    b->next = big;
+	} else {
+	    big->next = NULL;
+	    a->head = big;
+	}
+	return (char *)big + ARENA_HEADER;
+    }
+
+    if ((b = a->spare) != NULL)
+	a->spare = b->next;
+    else if (!(b = arena__new_block(a->block_size)))
+	return NULL;
+    b->next = a->head;
+    a->head = b;
+    b->used = size;
+    return (char *)b + ARENA_HEADER;
+}
+
+void *arena_calloc(Arena a, size_t nobjs, size_t size) {
+    if (size && nobjs > SIZE_MAX / size)
+	return NULL;
+    void *p = arena_alloc(a, nobjs * size);
+    if (p)
+	memset(p, 0, nobjs * size);
+    return p;
+}
+
+void *arena_realloc(Arena a, void *p, size_t oldsize, size_t newsize) {
+    if (newsize <= oldsize)
+	return p;
+    struct arena_block *b = a->head;
+    // the most recent allocation can be extended in place
+    if (p && b && (char *)p + ARENA_ROUNDUP(oldsize)
+	    == (char *)b + ARENA_HEADER + b->used
+	    && b->size - b->used >= ARENA_ROUNDUP(newsize) - ARENA_ROUNDUP(oldsize)) {
+	b->used += ARENA_ROUNDUP(newsize) - ARENA_ROUNDUP(oldsize);
+	return p;
+    }
+    void *np = arena_alloc(a, newsize);
+    if (np && p)
+	memcpy(np, p, oldsize);
+    return np;
+}
+
+int arena_add_cleanup(Arena a, arena_cleanupfunc func, void *ctx) {
+    assert(func);
+    struct arena_cleanup *cl = arena_alloc(a, sizeof(struct arena_cleanup));
+    if (!cl)
+	return -1;
+    cl->func = func;
+    cl->ctx = ctx;
+    cl->next = a->cleanups;
+    a->cleanups = cl;
+    return 0;
+}
+
+void arena_save(Arena a, struct arena_mark *m) {
+    m->head = a->head;
+    m->next = a->head ? a->head->next : NULL;
+    m->used = a->head ? a->head->used : 0;
+    m->cleanups = a->cleanups;
+}
+
+void arena_rollback(Arena a, const struct arena_mark *m) {
+    while (a->cleanups != m->cleanups) {
+	struct arena_cleanup *cl = a->cleanups;
+	a->cleanups = cl->next;
+	cl->func(cl->ctx);
+    }
+    // new blocks go in front of the marked one, large ones right behind
+    // whichever block was current
+    arena__drop_blocks(a, a->head, m->head);
+    a->head = m->head;
+    if (m->head) {
+	arena__drop_blocks(a, m->head->next, m->next);
+	m->head->next = m->next;
+	m->head->used = m->used;
+    }
+}
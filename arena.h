@@ -0,0 +1,61 @@
+#ifndef _ARENA_H
+#   define _ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (16384)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena_cleanup {
+    void (* func) (void *ctx);
+    void *ctx;
+    struct arena_cleanup *next;
+};
+
+struct arena {
+    struct arena_block *head;
+    struct arena_block *spare;	/* emptied by `arena_reset', for reuse */
+    struct arena_cleanup *cleanups;
+    size_t block_size;
+};
+
+/* a point to roll an arena back to, see `arena_save' */
+struct arena_mark {
+    struct arena_block *head;
+    struct arena_block *next;
+    size_t used;
+    struct arena_cleanup *cleanups;
+};
+
+typedef struct arena *Arena;
+typedef void (* arena_cleanupfunc) (void *ctx);
+
+/* `block_size' of 0 selects ARENA_BLOCK_SIZE. */
+Arena arena_new(size_t block_size);
+/* runs the registered cleanups (last registered first), then releases every
+ * block at once. */
+void arena_free(Arena a);
+/* same, but keeps the arena and its regular-sized blocks for reuse. */
+void arena_reset(Arena a);
+/* returned memory is aligned for any scalar type; it is never freed
+ * individually. */
+void *arena_alloc(Arena a, size_t size);
+void *arena_calloc(Arena a, size_t nobjs, size_t size);
+/* grows the most recent allocation in place while its block has room;
+ * anything else is copied into a new allocation and the old one is left
+ * behind until the arena is reset or freed. */
+void *arena_realloc(Arena a, void *p, size_t oldsize, size_t newsize);
+int arena_add_cleanup(Arena a, arena_cleanupfunc func, void *ctx);
+/* Remembers the current end of the arena.  `arena_rollback' then runs the
+ * cleanups registered since, and takes back everything allocated since,
+ * including in-place growth of older allocations.  A mark does not survive
+ * `arena_reset', or a rollback to an earlier mark. */
+void arena_save(Arena a, struct arena_mark *m);
+void arena_rollback(Arena a, const struct arena_mark *m);
+
+#endif
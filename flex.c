@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "flex.h"
 #include "amf3.h"
 
@@ -9,27 +10,42 @@ struct flex_flags {
     char *fl;
     int nfl;
     int pos;
+    char inline_fl[8];		/* enough for any message seen so far */
 };
 
-static int flex_parse_flags(AMF3ParseContext c, struct flex_flags *ff) {
+/* on failure `ff' holds no flags, so that no optional field is read. */
+static int flex_read_flags(const char **p, int *left, int *starved,
+	struct flex_flags *ff) {
     char b;
     int i = 0;
-    while(i < c->left && ((b = c->p[i]) & 0x80))
-	i++;
-    ff->nfl = i + 1;
+    ff->fl = NULL;
+    ff->nfl = 0;
     ff->pos = 0;
-    ff->fl = CALLOC(ff->nfl, char);
+    while(i < *left && ((b = (*p)[i]) & 0x80))
+	i++;
+    if (i == *left) {
+	// the message is cut short here
+	*starved = 1;
+	return -1;
+    }
+    ff->fl = (i + 1 <= (int)sizeof(ff->inline_fl))
+	? ff->inline_fl : CALLOC(i + 1, char);
     if (!ff->fl)
 	return -1;
+    ff->nfl = i + 1;
     for (i = 0; i < ff->nfl; i++)
-	ff->fl[i] = c->p[i] & 0x7F;
-    c->p += ff->nfl;
-    c->left -= ff->nfl;
+	ff->fl[i] = (*p)[i] & 0x7F;
+    *p += ff->nfl;
+    *left -= ff->nfl;
     return 0;
 }
 
+static int flex_parse_flags(AMF3ParseContext c, struct flex_flags *ff) {
+    return flex_read_flags(&c->p, &c->left, &c->starved, ff);
+}
+
 static void flex_flags_free(struct flex_flags *ff) {
-    if (ff->fl)
+    if (ff->fl && ff->fl != ff->inline_fl)
 	free(ff->fl);
     ff->fl = NULL;
     ff->pos = 0;
@@ -92,8 +108,12 @@ int flex_parse_abstractmessage(
 
     int ntails = flex_flags_countbits(&ff);
     flex_flags_free(&ff);
-    for (; ntails > 0; ntails--)
-	amf3_release(amf3_parse_value(c));
+    for (; ntails > 0; ntails--) {
+	AMF3Value tail = amf3_parse_value(c);
+	if (!tail)
+	    break;
+	amf3_release(tail);
+    }
 
     *external_ctx = am;
     return 0;
@@ -101,6 +121,8 @@ int flex_parse_abstractmessage(
 
 void flex_free_abstractmessage(void *AM) {
     Flex_AbstractMessage *am = (Flex_AbstractMessage *)AM;
+    if (!am)
+	return;
     if (am->body)
 	amf3_release(am->body);
     if (am->client_id)
@@ -122,6 +144,47 @@ void flex_free_abstractmessage(void *AM) {
     free(am);
 }
 
+/* an optional field of a message, present if `mask' is set in flags byte
+ * `byte' */
+struct flex_field {
+    int byte;
+    char mask;
+    const char *name;
+};
+
+/* whether `name' of `length' bytes is the field name `field'. */
+static int flex__is(const char *name, int length, const char *field) {
+    return (int)strlen(field) == length && memcmp(name, field, length) == 0;
+}
+
+static int flex__visit_field(AMF3VisitContext c, const char *name) {
+    if (amf3_visit_key(c, name, strlen(name)) != 0)
+	return -1;
+    return amf3_visit_value(c);
+}
+
+/* visits the fields present in a flags header, skipping unknown ones. */
+static int flex__visit_fields(AMF3VisitContext c,
+	const struct flex_field *fields, int nfield) {
+    struct flex_flags ff;
+    if (flex_read_flags(&c->p, &c->left, &c->starved, &ff) != 0)
+	return -1;
+
+    int i, byte = 0, r = 0;
+    for (i = 0; i < nfield && r == 0; i++) {
+	for (; byte < fields[i].byte; byte++)
+	    flex_flags_next(&ff);
+	if (flex_flags_toggle(&ff, fields[i].mask))
+	    r = flex__visit_field(c, fields[i].name);
+    }
+
+    int ntails = flex_flags_countbits(&ff);
+    flex_flags_free(&ff);
+    for (; r == 0 && ntails > 0; ntails--)
+	r = amf3_visit_skip(c);
+    return r;
+}
+
 static void flex__dump_amf3_value(const char *key, AMF3Value value, int depth) {
     if (!value)
 	return;
@@ -169,6 +232,67 @@ void flex_dump_abstractmessage(void *AM, int depth) {
     flex__dump_uuid("messageIdBytes", am->message_id_bytes, depth);
 }
 
+static void flex__foreach(AMF3Value v, AMF3ValueIterFunc func, void *ctx) {
+    if (v)
+	func(v, ctx);
+}
+
+void flex_foreach_abstractmessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx) {
+    Flex_AbstractMessage *am = (Flex_AbstractMessage *)AM;
+    flex__foreach(am->body, func, ctx);
+    flex__foreach(am->client_id, func, ctx);
+    flex__foreach(am->destination, func, ctx);
+    flex__foreach(am->headers, func, ctx);
+    flex__foreach(am->message_id, func, ctx);
+    flex__foreach(am->timestamp, func, ctx);
+    flex__foreach(am->ttl, func, ctx);
+    flex__foreach(am->client_id_bytes, func, ctx);
+    flex__foreach(am->message_id_bytes, func, ctx);
+}
+
+int flex_visit_abstractmessage(
+	AMF3VisitContext c, const char *classname, int length) {
+    static const struct flex_field fields[] = {
+	{0, BODY_FLAG, "body"},
+	{0, CLIENT_ID_FLAG, "clientId"},
+	{0, DESTINATION_FLAG, "destination"},
+	{0, HEADERS_FLAG, "headers"},
+	{0, MESSAGE_ID_FLAG, "messageId"},
+	{0, TIMESTAMP_FLAG, "timestamp"},
+	{0, TIME_TO_LIVE_FLAG, "timeToLive"},
+	{1, CLIENT_ID_BYTES_FLAG, "clientIdBytes"},
+	{1, MESSAGE_ID_BYTES_FLAG, "messageIdBytes"}
+    };
+    (void)classname;
+    (void)length;
+    return flex__visit_fields(c, fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+AMF3Value flex_get_abstractmessage(
+	void *AM, const char *name, int length) {
+    Flex_AbstractMessage *am = (Flex_AbstractMessage *)AM;
+    if (flex__is(name, length, "body"))
+	return am->body;
+    if (flex__is(name, length, "clientId"))
+	return am->client_id;
+    if (flex__is(name, length, "destination"))
+	return am->destination;
+    if (flex__is(name, length, "headers"))
+	return am->headers;
+    if (flex__is(name, length, "messageId"))
+	return am->message_id;
+    if (flex__is(name, length, "timestamp"))
+	return am->timestamp;
+    if (flex__is(name, length, "timeToLive"))
+	return am->ttl;
+    if (flex__is(name, length, "clientIdBytes"))
+	return am->client_id_bytes;
+    if (flex__is(name, length, "messageIdBytes"))
+	return am->message_id_bytes;
+    return NULL;
+}
+
 int flex_serialize_abstractmessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     Flex_AbstractMessage *am = (Flex_AbstractMessage *)external_ctx;
@@ -231,8 +355,12 @@ int flex_parse_asyncmessage(
 
     int ntails = flex_flags_countbits(&ff);
     flex_flags_free(&ff);
-    for (; ntails > 0; ntails--)
-	amf3_release(amf3_parse_value(c));
+    for (; ntails > 0; ntails--) {
+	AMF3Value tail = amf3_parse_value(c);
+	if (!tail)
+	    break;
+	amf3_release(tail);
+    }
 
     *external_ctx = am;
     return 0;
@@ -240,6 +368,8 @@ int flex_parse_asyncmessage(
 
 void flex_free_asyncmessage(void *AM) {
     Flex_AsyncMessage *am = (Flex_AsyncMessage *)AM;
+    if (!am)
+	return;
     flex_free_abstractmessage(am->am);
     if (am->correlation_id)
 	amf3_release(am->correlation_id);
@@ -255,6 +385,35 @@ void flex_dump_asyncmessage(void *AM, int depth) {
     flex__dump_uuid("correlationIdBytes", am->correlation_id_bytes, depth);
 }
 
+void flex_foreach_asyncmessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx) {
+    Flex_AsyncMessage *am = (Flex_AsyncMessage *)AM;
+    flex_foreach_abstractmessage(am->am, func, ctx);
+    flex__foreach(am->correlation_id, func, ctx);
+    flex__foreach(am->correlation_id_bytes, func, ctx);
+}
+
+int flex_visit_asyncmessage(
+	AMF3VisitContext c, const char *classname, int length) {
+    static const struct flex_field fields[] = {
+	{0, CORRELATION_ID_FLAG, "correlationId"},
+	{0, CORRELATION_ID_BYTES_FLAG, "correlationIdBytes"}
+    };
+    if (flex_visit_abstractmessage(c, classname, length) != 0)
+	return -1;
+    return flex__visit_fields(c, fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+AMF3Value flex_get_asyncmessage(
+	void *AM, const char *name, int length) {
+    Flex_AsyncMessage *am = (Flex_AsyncMessage *)AM;
+    if (flex__is(name, length, "correlationId"))
+	return am->correlation_id;
+    if (flex__is(name, length, "correlationIdBytes"))
+	return am->correlation_id_bytes;
+    return flex_get_abstractmessage(am->am, name, length);
+}
+
 int flex_serialize_asyncmessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     Flex_AsyncMessage *am = (Flex_AsyncMessage *)external_ctx;
@@ -290,6 +449,21 @@ void flex_dump_asyncmessageext(void *am, int depth) {
     flex_dump_asyncmessage(am, depth);
 }
 
+void flex_foreach_asyncmessageext(
+	void *am, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_asyncmessage(am, func, ctx);
+}
+
+int flex_visit_asyncmessageext(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_asyncmessage(c, classname, length);
+}
+
+AMF3Value flex_get_asyncmessageext(
+	void *am, const char *name, int length) {
+    return flex_get_asyncmessage(am, name, length);
+}
+
 int flex_serialize_asyncmessageext(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_asyncmessage(c, classname, external_ctx);
@@ -313,8 +487,12 @@ int flex_parse_acknowledgemessage(
 
     int ntails = flex_flags_countbits(&ff);
     flex_flags_free(&ff);
-    for (; ntails > 0; ntails--)
-	amf3_release(amf3_parse_value(c));
+    for (; ntails > 0; ntails--) {
+	AMF3Value tail = amf3_parse_value(c);
+	if (!tail)
+	    break;
+	amf3_release(tail);
+    }
 
     *external_ctx = am;
     return 0;
@@ -322,6 +500,8 @@ int flex_parse_acknowledgemessage(
 
 void flex_free_acknowledgemessage(void *AM) {
     Flex_AcknowledgeMessage *am = (Flex_AcknowledgeMessage *)AM;
+    if (!am)
+	return;
     flex_free_asyncmessage(am->am);
     free(am);
 }
@@ -331,6 +511,26 @@ void flex_dump_acknowledgemessage(void *AM, int depth) {
     flex_dump_asyncmessage(am->am, depth);
 }
 
+void flex_foreach_acknowledgemessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx) {
+    Flex_AcknowledgeMessage *am = (Flex_AcknowledgeMessage *)AM;
+    flex_foreach_asyncmessage(am->am, func, ctx);
+}
+
+int flex_visit_acknowledgemessage(
+	AMF3VisitContext c, const char *classname, int length) {
+    if (flex_visit_asyncmessage(c, classname, length) != 0)
+	return -1;
+    /* No flags defined */
+    return flex__visit_fields(c, NULL, 0);
+}
+
+AMF3Value flex_get_acknowledgemessage(
+	void *AM, const char *name, int length) {
+    Flex_AcknowledgeMessage *am = (Flex_AcknowledgeMessage *)AM;
+    return flex_get_asyncmessage(am->am, name, length);
+}
+
 int flex_serialize_acknowledgemessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     Flex_AcknowledgeMessage *am = (Flex_AcknowledgeMessage *)external_ctx;
@@ -352,6 +552,21 @@ void flex_dump_acknowledgemessageext(void *am, int depth) {
     flex_dump_acknowledgemessage(am, depth);
 }
 
+void flex_foreach_acknowledgemessageext(
+	void *am, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_acknowledgemessage(am, func, ctx);
+}
+
+int flex_visit_acknowledgemessageext(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_acknowledgemessage(c, classname, length);
+}
+
+AMF3Value flex_get_acknowledgemessageext(
+	void *am, const char *name, int length) {
+    return flex_get_acknowledgemessage(am, name, length);
+}
+
 int flex_serialize_acknowledgemessageext(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_acknowledgemessage(c, classname, external_ctx);
@@ -370,6 +585,21 @@ void flex_dump_errormessage(void *em, int depth) {
     flex_dump_acknowledgemessage(em, depth);
 }
 
+void flex_foreach_errormessage(
+	void *em, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_acknowledgemessage(em, func, ctx);
+}
+
+int flex_visit_errormessage(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_acknowledgemessage(c, classname, length);
+}
+
+AMF3Value flex_get_errormessage(
+	void *em, const char *name, int length) {
+    return flex_get_acknowledgemessage(em, name, length);
+}
+
 int flex_serialize_errormessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_errormessage(c, classname, external_ctx);
@@ -394,8 +624,12 @@ int flex_parse_commandmessage(
 
     int ntails = flex_flags_countbits(&ff);
     flex_flags_free(&ff);
-    for (; ntails > 0; ntails--)
-	amf3_release(amf3_parse_value(c));
+    for (; ntails > 0; ntails--) {
+	AMF3Value tail = amf3_parse_value(c);
+	if (!tail)
+	    break;
+	amf3_release(tail);
+    }
 
     *external_ctx = am;
     return 0;
@@ -403,8 +637,11 @@ int flex_parse_commandmessage(
 
 void flex_free_commandmessage(void *CM) {
     Flex_CommandMessage *cm = (Flex_CommandMessage *)CM;
+    if (!cm)
+	return;
     flex_free_asyncmessage(cm->am);
-    amf3_release(cm->operation);
+    if (cm->operation)
+	amf3_release(cm->operation);
     free(cm);
 }
 
@@ -414,6 +651,31 @@ void flex_dump_commandmessage(void *CM, int depth) {
     flex__dump_amf3_value("operation", cm->operation, depth);
 }
 
+void flex_foreach_commandmessage(
+	void *CM, AMF3ValueIterFunc func, void *ctx) {
+    Flex_CommandMessage *cm = (Flex_CommandMessage *)CM;
+    flex_foreach_asyncmessage(cm->am, func, ctx);
+    flex__foreach(cm->operation, func, ctx);
+}
+
+int flex_visit_commandmessage(
+	AMF3VisitContext c, const char *classname, int length) {
+    static const struct flex_field fields[] = {
+	{0, OPERATION_FLAG, "operation"}
+    };
+    if (flex_visit_asyncmessage(c, classname, length) != 0)
+	return -1;
+    return flex__visit_fields(c, fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+AMF3Value flex_get_commandmessage(
+	void *CM, const char *name, int length) {
+    Flex_CommandMessage *cm = (Flex_CommandMessage *)CM;
+    if (flex__is(name, length, "operation"))
+	return cm->operation;
+    return flex_get_asyncmessage(cm->am, name, length);
+}
+
 int flex_serialize_commandmessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     Flex_CommandMessage *cm = (Flex_CommandMessage *)external_ctx;
@@ -443,6 +705,21 @@ void flex_dump_commandmessageext(void *cm, int depth) {
     flex_dump_commandmessage(cm, depth);
 }
 
+void flex_foreach_commandmessageext(
+	void *cm, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_commandmessage(cm, func, ctx);
+}
+
+int flex_visit_commandmessageext(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_commandmessage(c, classname, length);
+}
+
+AMF3Value flex_get_commandmessageext(
+	void *cm, const char *name, int length) {
+    return flex_get_commandmessage(cm, name, length);
+}
+
 int flex_serialize_commandmessageext(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_commandmessage(c, classname, external_ctx);
@@ -460,7 +737,10 @@ int flex_parse_arraycollection(
 
 void flex_free_arraycollection(void *AC) {
     Flex_ArrayCollection *ac = (Flex_ArrayCollection *)AC;
-    amf3_release(ac->source);
+    if (!ac)
+	return;
+    if (ac->source)
+	amf3_release(ac->source);
     free(ac);
 }
 
@@ -469,6 +749,25 @@ void flex_dump_arraycollection(void *AC, int depth) {
     flex__dump_amf3_value("source", ac->source, depth);
 }
 
+void flex_foreach_arraycollection(
+	void *AC, AMF3ValueIterFunc func, void *ctx) {
+    Flex_ArrayCollection *ac = (Flex_ArrayCollection *)AC;
+    flex__foreach(ac->source, func, ctx);
+}
+
+int flex_visit_arraycollection(
+	AMF3VisitContext c, const char *classname, int length) {
+    (void)classname;
+    (void)length;
+    return flex__visit_field(c, "source");
+}
+
+AMF3Value flex_get_arraycollection(
+	void *AC, const char *name, int length) {
+    Flex_ArrayCollection *ac = (Flex_ArrayCollection *)AC;
+    return flex__is(name, length, "source") ? ac->source : NULL;
+}
+
 int flex_serialize_arraycollection(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return amf3_serialize_value(c, ((Flex_ArrayCollection *)external_ctx)->source);
@@ -487,6 +786,21 @@ void flex_dump_arraylist(void *al, int depth) {
     flex_dump_arraycollection(al, depth);
 }
 
+void flex_foreach_arraylist(
+	void *al, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_arraycollection(al, func, ctx);
+}
+
+int flex_visit_arraylist(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_arraycollection(c, classname, length);
+}
+
+AMF3Value flex_get_arraylist(
+	void *al, const char *name, int length) {
+    return flex_get_arraycollection(al, name, length);
+}
+
 int flex_serialize_arraylist(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_arraycollection(c, classname, external_ctx);
@@ -504,7 +818,10 @@ int flex_parse_objectproxy(
 
 void flex_free_objectproxy(void *OP) {
     Flex_ObjectProxy *op = (Flex_ObjectProxy *)OP;
-    amf3_release(op->object);
+    if (!op)
+	return;
+    if (op->object)
+	amf3_release(op->object);
     free(op);
 }
 
@@ -513,6 +830,25 @@ void flex_dump_objectproxy(void *OP, int depth) {
     flex__dump_amf3_value("object", op->object, depth);
 }
 
+void flex_foreach_objectproxy(
+	void *OP, AMF3ValueIterFunc func, void *ctx) {
+    Flex_ObjectProxy *op = (Flex_ObjectProxy *)OP;
+    flex__foreach(op->object, func, ctx);
+}
+
+int flex_visit_objectproxy(
+	AMF3VisitContext c, const char *classname, int length) {
+    (void)classname;
+    (void)length;
+    return flex__visit_field(c, "object");
+}
+
+AMF3Value flex_get_objectproxy(
+	void *OP, const char *name, int length) {
+    Flex_ObjectProxy *op = (Flex_ObjectProxy *)OP;
+    return flex__is(name, length, "object") ? op->object : NULL;
+}
+
 int flex_serialize_objectproxy(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return amf3_serialize_value(c, ((Flex_ObjectProxy *)external_ctx)->object);
@@ -531,6 +867,21 @@ void flex_dump_managedobjectproxy(void *mop, int depth) {
     flex_dump_objectproxy(mop, depth);
 }
 
+void flex_foreach_managedobjectproxy(
+	void *mop, AMF3ValueIterFunc func, void *ctx) {
+    flex_foreach_objectproxy(mop, func, ctx);
+}
+
+int flex_visit_managedobjectproxy(
+	AMF3VisitContext c, const char *classname, int length) {
+    return flex_visit_objectproxy(c, classname, length);
+}
+
+AMF3Value flex_get_managedobjectproxy(
+	void *mop, const char *name, int length) {
+    return flex_get_objectproxy(mop, name, length);
+}
+
 int flex_serialize_managedobjectproxy(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return flex_serialize_objectproxy(c, classname, external_ctx);
@@ -548,7 +899,10 @@ int flex_parse_serializationproxy(
 
 void flex_free_serializationproxy(void *SP) {
     Flex_SerializationProxy *sp = (Flex_SerializationProxy *)SP;
-    amf3_release(sp->default_instance);
+    if (!sp)
+	return;
+    if (sp->default_instance)
+	amf3_release(sp->default_instance);
     free(sp);
 }
 
@@ -557,6 +911,26 @@ void flex_dump_serializationproxy(void *SP, int depth) {
     flex__dump_amf3_value("defaultInstance", sp->default_instance, depth);
 }
 
+void flex_foreach_serializationproxy(
+	void *SP, AMF3ValueIterFunc func, void *ctx) {
+    Flex_SerializationProxy *sp = (Flex_SerializationProxy *)SP;
+    flex__foreach(sp->default_instance, func, ctx);
+}
+
+int flex_visit_serializationproxy(
+	AMF3VisitContext c, const char *classname, int length) {
+    (void)classname;
+    (void)length;
+    return flex__visit_field(c, "defaultInstance");
+}
+
+AMF3Value flex_get_serializationproxy(
+	void *SP, const char *name, int length) {
+    Flex_SerializationProxy *sp = (Flex_SerializationProxy *)SP;
+    return flex__is(name, length, "defaultInstance")
+	? sp->default_instance : NULL;
+}
+
 int flex_serialize_serializationproxy(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx) {
     return amf3_serialize_value(c,
@@ -149,6 +149,87 @@ void flex_dump_objectproxy(void *OP, int depth);
 void flex_dump_managedobjectproxy(void *mop, int depth);
 void flex_dump_serializationproxy(void *SP, int depth);
 
+void flex_foreach_abstractmessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_asyncmessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_asyncmessageext(
+	void *am, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_acknowledgemessage(
+	void *AM, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_acknowledgemessageext(
+	void *am, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_errormessage(
+	void *em, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_commandmessage(
+	void *CM, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_commandmessageext(
+	void *cm, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_arraycollection(
+	void *AC, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_arraylist(
+	void *al, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_objectproxy(
+	void *OP, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_managedobjectproxy(
+	void *mop, AMF3ValueIterFunc func, void *ctx);
+void flex_foreach_serializationproxy(
+	void *SP, AMF3ValueIterFunc func, void *ctx);
+
+int flex_visit_abstractmessage(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_asyncmessage(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_asyncmessageext(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_acknowledgemessage(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_acknowledgemessageext(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_errormessage(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_commandmessage(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_commandmessageext(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_arraycollection(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_arraylist(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_objectproxy(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_managedobjectproxy(
+	AMF3VisitContext c, const char *classname, int length);
+int flex_visit_serializationproxy(
+	AMF3VisitContext c, const char *classname, int length);
+
+AMF3Value flex_get_abstractmessage(
+	void *AM, const char *name, int length);
+AMF3Value flex_get_asyncmessage(
+	void *AM, const char *name, int length);
+AMF3Value flex_get_asyncmessageext(
+	void *am, const char *name, int length);
+AMF3Value flex_get_acknowledgemessage(
+	void *AM, const char *name, int length);
+AMF3Value flex_get_acknowledgemessageext(
+	void *am, const char *name, int length);
+AMF3Value flex_get_errormessage(
+	void *em, const char *name, int length);
+AMF3Value flex_get_commandmessage(
+	void *CM, const char *name, int length);
+AMF3Value flex_get_commandmessageext(
+	void *cm, const char *name, int length);
+AMF3Value flex_get_arraycollection(
+	void *AC, const char *name, int length);
+AMF3Value flex_get_arraylist(
+	void *al, const char *name, int length);
+AMF3Value flex_get_objectproxy(
+	void *OP, const char *name, int length);
+AMF3Value flex_get_managedobjectproxy(
+	void *mop, const char *name, int length);
+AMF3Value flex_get_serializationproxy(
+	void *SP, const char *name, int length);
+
 int flex_serialize_abstractmessage(
 	AMF3SerializeContext c, AMF3Value classname, void *external_ctx);
 int flex_serialize_asyncmessage(
@@ -0,0 +1,1006 @@
+/* Round-trip tests for the AMF3 parser and serializer.
+ *
+ *   cc -DHAVE_FLEX_COMMON_OBJECTS -iquote . -o amf3_test tests/amf3_test.c \
+ *	amf3.c arena.c flex.c -lpthread && ./amf3_test
+ *
+ * Exits non-zero if any check fails. */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amf3.h"
+#include "flex.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", \
+		__FILE__, __LINE__, #cond); \
+	failures++; \
+    } \
+} while (0)
+
+static void push_release(AMF3Value a, AMF3Value v) {
+    amf3_array_push(a, v);
+    amf3_release(v);
+}
+
+/* a message using every type, references of each kind, and payloads long
+ * enough for AMF3_SERIALIZE_IOVEC. */
+static AMF3Value build_message() {
+    AMF3Value names[2] = {
+	amf3_new_string_utf8("id"), amf3_new_string_utf8("name")
+    };
+    AMF3Value row = amf3_new_string_utf8("Row");
+    AMF3Value root = amf3_new_array();
+    int i;
+    for (i = 0; i < 40; i++) {
+	AMF3Value o = amf3_new_object(row, 1, names, 2);
+	AMF3Value v = amf3_new_integer(i * 37 - 100);
+	amf3_object_prop_set(o, names[0], v);
+	amf3_release(v);
+	char buf[16];
+	snprintf(buf, sizeof(buf), "n%d", i % 7);
+	v = amf3_new_string_utf8(buf);
+	amf3_object_prop_set(o, names[1], v);
+	amf3_release(v);
+	AMF3Value k = amf3_new_string_utf8(i % 2 ? "odd" : "even");
+	v = amf3_new_double(i * 0.5);
+	amf3_object_prop_set(o, k, v);
+	amf3_release(v);
+	amf3_release(k);
+	amf3_array_push(root, o);
+	if (i % 10 == 0)
+	    amf3_array_push(root, o);
+	amf3_release(o);
+    }
+
+    AMF3Value k = amf3_new_string_utf8("total");
+    AMF3Value v = amf3_new_integer(40);
+    amf3_array_assoc_set(root, k, v);
+    amf3_release(k);
+    amf3_release(v);
+
+    char big[1024];
+    for (i = 0; i < (int)sizeof(big); i++)
+	big[i] = 'a' + i % 26;
+    v = amf3_new_bytearray(big, sizeof(big));
+    amf3_array_push(root, v);
+    amf3_array_push(root, v);
+    amf3_release(v);
+    push_release(root, amf3_new_string(big, 700));
+    push_release(root, amf3_new_string(big, 700));
+    push_release(root, amf3_new_xml("<a/>", 4));
+    push_release(root, amf3_new_xmldoc("<b/>", 4));
+    push_release(root, amf3_new_date(12345.0));
+    push_release(root, amf3_new_true());
+    push_release(root, amf3_new_false());
+    push_release(root, amf3_new_null());
+    push_release(root, amf3_new_undefined());
+    push_release(root, amf3_new_integer(-268435456));
+    push_release(root, amf3_new_integer(268435455));
+    push_release(root, amf3_new_double(-1.5e300));
+    push_release(root, amf3_new_object(NULL, 1, NULL, 0));
+
+    amf3_release(row);
+    amf3_release(names[0]);
+    amf3_release(names[1]);
+    return root;
+}
+
+static char *serialize(AMF3Value v, int *len) {
+    AMF3SerializeContext c = amf3_serialize_context_new();
+    amf3_serialize_value(c, v);
+    const char *out = amf3_serialize_context_get_buffer(c, len);
+    char *copy = malloc(*len);
+    memcpy(copy, out, *len);
+    amf3_serialize_context_free(c);
+    return copy;
+}
+
+/* whether `v' encodes to exactly `len' bytes of `data' */
+static int encodes_to(AMF3Value v, const char *data, int len) {
+    int n;
+    char *out = serialize(v, &n);
+    int same = n == len && memcmp(out, data, len) == 0;
+    free(out);
+    return same;
+}
+
+static size_t arena_used(Arena a) {
+    size_t used = 0;
+    struct arena_block *b;
+    for (b = a->head; b; b = b->next)
+	used += b->used;
+    return used;
+}
+
+static void test_arena() {
+    Arena a = arena_new(0);
+    CHECK(arena_calloc(a, SIZE_MAX / 2, 4) == NULL);
+    // only the latest allocation grows in place
+    char *p = arena_alloc(a, 10);
+    size_t used = arena_used(a);
+    CHECK(arena_realloc(a, p, 10, 100) == p && arena_used(a) > used);
+    CHECK(arena_alloc(a, 10) != NULL);
+    CHECK(arena_realloc(a, p, 100, 200) != p);
+    arena_free(a);
+}
+
+static void test_parse_flags(const char *data, int len) {
+    static const int flags[] = {
+	0,
+	AMF3_PARSE_ARENA,
+	AMF3_PARSE_BORROW,
+	AMF3_PARSE_INTERN,
+	AMF3_PARSE_LAZY,
+	AMF3_PARSE_ARENA | AMF3_PARSE_BORROW | AMF3_PARSE_INTERN,
+	AMF3_PARSE_LAZY | AMF3_PARSE_INTERN,
+    };
+    int i;
+    for (i = 0; i < (int)(sizeof(flags) / sizeof(flags[0])); i++) {
+	AMF3ParseContext c = amf3_parse_context_new_ex(data, len, flags[i]);
+	AMF3Value v = amf3_parse_value(c);
+	CHECK(v && c->left == 0);
+	if (v) {
+	    CHECK(encodes_to(v, data, len));
+	    amf3_release(v);
+	}
+	amf3_parse_context_free(c);
+    }
+}
+
+/* the arena may go before the context it was detached from. */
+static void test_detach(const char *data, int len) {
+    AMF3ParseContext c = amf3_parse_context_new_ex(data, len,
+	    AMF3_PARSE_ARENA | AMF3_PARSE_INTERN);
+    AMF3Value v = amf3_parse_value(c);
+    Arena a = amf3_parse_context_detach_arena(c);
+    CHECK(v && a && encodes_to(v, data, len));
+    arena_free(a);
+    amf3_parse_context_free(c);
+
+    AMF3PushParser p = amf3_push_parser_new(AMF3_PARSE_ARENA);
+    CHECK(amf3_push_parser_feed(p, data, len, NULL) == AMF3_PUSH_DONE);
+    v = amf3_push_parser_take(p);
+    a = amf3_push_parser_detach_arena(p);
+    CHECK(v && a && encodes_to(v, data, len));
+    arena_free(a);
+    amf3_push_parser_free(p);
+
+    // detaching halfway through fails the parser
+    p = amf3_push_parser_new(AMF3_PARSE_ARENA);
+    CHECK(amf3_push_parser_feed(p, data, len / 2, NULL) == AMF3_PUSH_MORE);
+    arena_free(amf3_push_parser_detach_arena(p));
+    CHECK(amf3_push_parser_feed(p, data + len / 2, len - len / 2, NULL)
+	    == AMF3_PUSH_ERROR);
+    amf3_push_parser_free(p);
+}
+
+/* anonymous classes differ by their members, so two of them with the same
+ * empty name must not share traits; equal ones still do. */
+static void test_traits() {
+    AMF3Value a = amf3_new_string_utf8("a");
+    AMF3Value b = amf3_new_string_utf8("b");
+    AMF3Value root = amf3_new_array();
+    int i;
+    for (i = 0; i < 3; i++) {
+	AMF3Value name = i == 1 ? b : a;
+	AMF3Value o = amf3_new_object(NULL, 0, &name, 1);
+	AMF3Value v = amf3_new_integer(i);
+	amf3_object_prop_set(o, name, v);
+	amf3_release(v);
+	push_release(root, o);
+    }
+    int n;
+    char *out = serialize(root, &n);
+    amf3_release(root);
+
+    AMF3ParseContext c = amf3_parse_context_new(out, n);
+    AMF3Value v = amf3_parse_value(c);
+    CHECK(v && amf3_array_len(v) == 3);
+    if (v) {
+	AMF3Value o0 = amf3_array_get(v, 0);
+	AMF3Value o1 = amf3_array_get(v, 1);
+	AMF3Value o2 = amf3_array_get(v, 2);
+	CHECK(amf3_string_cmp(amf3_traits_member_name_get(o1, 0), b) == 0);
+	AMF3Value m = amf3_object_prop_get(o1, b);
+	CHECK(m && m->type == AMF3_INTEGER && m->v.integer == 1);
+	CHECK(amf3_object_traits_get(o2) == amf3_object_traits_get(o0));
+	amf3_release(v);
+    }
+    amf3_parse_context_free(c);
+    free(out);
+    amf3_release(a);
+    amf3_release(b);
+}
+
+/* singletons are shared, and retaining or releasing them does nothing. */
+static void test_singletons() {
+    AMF3Value atoms[] = {
+	amf3_new_undefined(), amf3_new_null(), amf3_new_false(),
+	amf3_new_true(), amf3_new_integer(AMF3_SMALLINT_MIN),
+	amf3_new_integer(0), amf3_new_integer(AMF3_SMALLINT_MAX)
+    };
+    int i;
+    for (i = 0; i < (int)(sizeof(atoms) / sizeof(atoms[0])); i++) {
+	AMF3Value v = atoms[i];
+	int count = v->retain_count;
+	CHECK(v->flags & AMF3_VALUE_IMMORTAL);
+	amf3_retain(v);
+	amf3_retain(v);
+	amf3_release(v);
+	amf3_release(v);
+	amf3_release(v);
+	CHECK(v->retain_count == count);
+    }
+    CHECK(amf3_new_null() == atoms[1] && amf3_new_integer(0) == atoms[5]);
+    CHECK(atoms[6]->type == AMF3_INTEGER &&
+	    atoms[6]->v.integer == AMF3_SMALLINT_MAX);
+
+    AMF3Value big = amf3_new_integer(AMF3_SMALLINT_MAX + 1);
+    AMF3Value big2 = amf3_new_integer(AMF3_SMALLINT_MAX + 1);
+    CHECK(big != big2 && !(big->flags & AMF3_VALUE_IMMORTAL) &&
+	    big->retain_count == 1);
+    amf3_release(big);
+    amf3_release(big2);
+
+    // the parser hands them out too, arena or not
+    static const char in[] = {
+	AMF3_ARRAY, 0x07, 0x01, AMF3_NULL, AMF3_TRUE, AMF3_INTEGER, 0x05
+    };
+    for (i = 0; i < 2; i++) {
+	AMF3ParseContext c = amf3_parse_context_new_ex(in, sizeof(in),
+		i ? AMF3_PARSE_ARENA : 0);
+	AMF3Value v = amf3_parse_value(c);
+	CHECK(v && amf3_array_get(v, 0) == amf3_new_null() &&
+		amf3_array_get(v, 1) == amf3_new_true() &&
+		amf3_array_get(v, 2) == amf3_new_integer(5));
+	if (v)
+	    amf3_release(v);
+	amf3_parse_context_free(c);
+    }
+}
+
+static AMF3Value new_row(AMF3Value type, char dynamic, AMF3Value *names,
+	int nmemb, AMF3Value name, const char *value) {
+    AMF3Value o = amf3_new_object(type, dynamic, names, nmemb);
+    AMF3Value v = amf3_new_string_utf8(value);
+    amf3_object_prop_set(o, name, v);
+    amf3_release(v);
+    return o;
+}
+
+/* an accessor keeps its slot for equal traits, and finds the property
+ * again once objects of another shape come by. */
+static void test_accessor() {
+    AMF3Value row = amf3_new_string_utf8("Row");
+    AMF3Value other = amf3_new_string_utf8("Other");
+    AMF3Value names[2] = {
+	amf3_new_string_utf8("id"), amf3_new_string_utf8("name")
+    };
+    AMF3Value swapped[2] = {names[1], names[0]};
+    struct amf3_accessor acc;
+    amf3_accessor_init(&acc, row, names[1]);
+
+    AMF3Value o = new_row(row, 0, names, 2, names[1], "x");
+    AMF3Value v = amf3_accessor_get(&acc, o);
+    CHECK(v && strcmp(amf3_string_cstr(v), "x") == 0 && acc.slot == 1);
+    amf3_release(o);
+
+    // equal traits of another object: the cached slot is reused
+    o = new_row(row, 0, names, 2, names[1], "y");
+    unsigned int hash = acc.traits_hash;
+    v = amf3_accessor_get(&acc, o);
+    CHECK(v && strcmp(amf3_string_cstr(v), "y") == 0);
+    CHECK(acc.slot == 1 && acc.traits_hash == hash &&
+	    acc.traits == amf3_object_traits_get(o));
+    amf3_release(o);
+
+    o = new_row(row, 0, swapped, 2, names[1], "z");
+    v = amf3_accessor_get(&acc, o);
+    CHECK(v && strcmp(amf3_string_cstr(v), "z") == 0 && acc.slot == 0);
+    amf3_release(o);
+
+    o = new_row(row, 1, names, 1, names[1], "w");
+    v = amf3_accessor_get(&acc, o);
+    CHECK(v && strcmp(amf3_string_cstr(v), "w") == 0 &&
+	    acc.slot == AMF3_ACCESSOR_DYNAMIC);
+    amf3_release(o);
+
+    o = new_row(other, 0, names, 2, names[1], "v");
+    CHECK(amf3_accessor_get(&acc, o) == NULL);
+    amf3_release(o);
+
+    amf3_accessor_cleanup(&acc);
+    amf3_release(names[0]);
+    amf3_release(names[1]);
+    amf3_release(row);
+    amf3_release(other);
+}
+
+/* interned strings are unique, so equal names are the same pointer. */
+static void test_intern(const char *data, int len) {
+    AMF3Value row = amf3_intern("Row", 3);
+    CHECK(row == amf3_intern("Row", 3) &&
+	    (row->flags & AMF3_VALUE_INTERNED));
+    AMF3Value s = amf3_new_string_utf8("Row");
+    CHECK(s != row && amf3_intern_value(s) == row &&
+	    amf3_intern_value(row) == row);
+    amf3_release(s);
+
+    int i;
+    for (i = 0; i < 2; i++) {
+	AMF3ParseContext c = amf3_parse_context_new_ex(data, len,
+		AMF3_PARSE_INTERN | (i ? AMF3_PARSE_ARENA : 0));
+	AMF3Value v = amf3_parse_value(c);
+	CHECK(v && amf3_traits_type_get(amf3_array_get(v, 0)) == row &&
+		amf3_traits_type_get(amf3_array_get(v, 3)) == row);
+	if (v)
+	    amf3_release(v);
+	amf3_parse_context_free(c);
+    }
+
+    char name[AMF3_INTERN_MAX_LENGTH + 1];
+    memset(name, 'x', sizeof(name));
+    AMF3Value a = amf3_intern(name, sizeof(name));
+    AMF3Value b = amf3_intern(name, sizeof(name));
+    CHECK(a != b && !(a->flags & AMF3_VALUE_INTERNED));
+    amf3_release(a);
+    amf3_release(b);
+}
+
+/* feeds `data' in pieces of `step' bytes; returns how much of the arena
+ * the value takes, if any. */
+static size_t check_push(const char *data, int len, int flags, int step) {
+    AMF3PushParser p = amf3_push_parser_new(flags);
+    int off = 0, r = AMF3_PUSH_MORE, consumed = 0;
+    while (r == AMF3_PUSH_MORE && off < len) {
+	int n = len - off < step ? len - off : step;
+	r = amf3_push_parser_feed(p, data + off, n, &consumed);
+	off += consumed;
+    }
+    CHECK(r == AMF3_PUSH_DONE && off == len);
+    AMF3Value v = amf3_push_parser_take(p);
+    CHECK(v && encodes_to(v, data, len));
+    if (v)
+	amf3_release(v);
+    size_t used = p->c->arena ? arena_used(p->c->arena) : 0;
+    amf3_push_parser_free(p);
+    return used;
+}
+
+static void test_push(const char *data, int len) {
+    check_push(data, len, 0, 1);
+    check_push(data, len, AMF3_PARSE_ARENA, 1);
+    check_push(data, len, 0, 4096);
+    check_push(data, len, AMF3_PARSE_ARENA | AMF3_PARSE_INTERN, 7);
+
+    // retries cut short by the end of a feed leave nothing in the arena;
+    // an object has nothing sized after the input at hand, unlike arrays
+    AMF3Value names[20];
+    int i, n;
+    for (i = 0; i < 20; i++) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "member%d", i);
+	names[i] = amf3_new_string_utf8(buf);
+    }
+    AMF3Value type = amf3_new_string_utf8("Wide");
+    AMF3Value o = amf3_new_object(type, 0, names, 20);
+    for (i = 0; i < 20; i++) {
+	AMF3Value v = amf3_new_integer(i);
+	amf3_object_prop_set(o, names[i], v);
+	amf3_release(v);
+	amf3_release(names[i]);
+    }
+    amf3_release(type);
+    char *out = serialize(o, &n);
+    amf3_release(o);
+    size_t used = check_push(out, n, AMF3_PARSE_ARENA, n);
+    CHECK(check_push(out, n, AMF3_PARSE_ARENA, 1) == used);
+    free(out);
+}
+
+/* an ArrayCollection around copies of the message, so that its body is
+ * cut across several feeds. */
+static AMF3Value build_collection(const char *data, int len) {
+    Flex_ArrayCollection *ac = calloc(1, sizeof(Flex_ArrayCollection));
+    ac->source = amf3_new_array();
+    int i;
+    for (i = 0; i < 4; i++) {
+	AMF3ParseContext c = amf3_parse_context_new(data, len);
+	push_release(ac->source, amf3_parse_value(c));
+	amf3_parse_context_free(c);
+    }
+    AMF3Value type = amf3_new_string_utf8("flex.messaging.io.ArrayCollection");
+    AMF3Value v = amf3_new_object_external(type, ac);
+    amf3_release(type);
+    return v;
+}
+
+static void test_push_external(const char *data, int len) {
+    AMF3Value ac = build_collection(data, len);
+    int n;
+    char *out = serialize(ac, &n);
+    amf3_release(ac);
+
+    check_push(out, n, 0, 4096);
+    check_push(out, n, 0, 1000);
+    size_t used = check_push(out, n, AMF3_PARSE_ARENA, n);
+    CHECK(check_push(out, n, AMF3_PARSE_ARENA, 4096) == used);
+    CHECK(check_push(out, n, AMF3_PARSE_ARENA, 1000) == used);
+    // the body is walked once across the feeds, not again on each
+    check_push(out, n, 0, 1);
+    CHECK(check_push(out, n, AMF3_PARSE_ARENA, 1) == used);
+    free(out);
+}
+
+struct trace {
+    char text[256];
+    int length;
+};
+
+static int trace_add(void *ctx, const char *fmt, ...) {
+    struct trace *t = ctx;
+    int room = (int)sizeof(t->text) - t->length;
+    if (t->length > 0 && room > 1) {
+	t->text[t->length++] = ' ';
+	room--;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->text + t->length, room, fmt, ap);
+    va_end(ap);
+    t->length += n < room ? n : room - 1;
+    return 0;
+}
+
+static int trace_atom(void *ctx, char type) {
+    return trace_add(ctx, "a%d", type);
+}
+
+static int trace_integer(void *ctx, int value) {
+    return trace_add(ctx, "i%d", value);
+}
+
+static int trace_string(void *ctx, const char *data, int length) {
+    return trace_add(ctx, "s:%.*s", length, data);
+}
+
+static int trace_reference(void *ctx, int idx, int offset) {
+    return trace_add(ctx, "r%d@%d", idx, offset);
+}
+
+static int trace_start_array(void *ctx, int dense_length) {
+    return trace_add(ctx, "[%d", dense_length);
+}
+
+static int trace_start_object(void *ctx,
+	const struct amf3_visit_traits *traits,
+	const struct amf3_strview *member_names) {
+    (void)member_names;
+    return trace_add(ctx, "{%.*s/%d", traits->classname.length,
+	    traits->classname.data, traits->nmemb);
+}
+
+static int trace_member(void *ctx, int idx, const char *name, int length) {
+    return trace_add(ctx, "m%d:%.*s", idx, length, name);
+}
+
+static int trace_key(void *ctx, const char *name, int length) {
+    return trace_add(ctx, "k:%.*s", length, name);
+}
+
+static int trace_end(void *ctx) {
+    return trace_add(ctx, "}");
+}
+
+static int trace_stop(void *ctx, const char *name, int length) {
+    trace_key(ctx, name, length);
+    return 1;
+}
+
+/* the callbacks come in input order, references with the offset of what
+ * they refer to. */
+static void test_visit() {
+    AMF3Value a = amf3_new_string_utf8("a");
+    AMF3Value type = amf3_new_string_utf8("T");
+    AMF3Value root = amf3_new_array();
+    AMF3Value k = amf3_new_string_utf8("k");
+    AMF3Value v = amf3_new_integer(1);
+    amf3_array_assoc_set(root, k, v);
+    amf3_release(k);
+    amf3_release(v);
+    push_release(root, amf3_new_string_utf8("s"));
+    AMF3Value o = amf3_new_object(type, 0, &a, 1);
+    v = amf3_new_true();
+    amf3_object_prop_set(o, a, v);
+    amf3_release(v);
+    amf3_array_push(root, o);
+    push_release(root, o);
+    push_release(root, amf3_new_null());
+    int n;
+    char *out = serialize(root, &n);
+    amf3_release(root);
+    amf3_release(type);
+    amf3_release(a);
+
+    struct amf3_visitor visitor = {
+	trace_atom, trace_integer, NULL, NULL, trace_string, NULL,
+	trace_reference, trace_start_array, trace_start_object,
+	trace_member, trace_key, trace_end
+    };
+    struct trace t = {"", 0};
+    AMF3VisitContext c = amf3_visit_context_new(out, n, &visitor, &t);
+    CHECK(amf3_visit_value(c) == 0 && c->left == 0);
+    CHECK(strcmp(t.text,
+		"[4 k:k i1 s:s {T/1 m0:a a3 } r1@10 a1 }") == 0);
+    amf3_visit_context_free(c);
+
+    // a callback returning non-zero ends the visit there
+    visitor.key = trace_stop;
+    t.length = 0;
+    c = amf3_visit_context_new(out, n, &visitor, &t);
+    CHECK(amf3_visit_value(c) != 0 && strcmp(t.text, "[4 k:k") == 0);
+    amf3_visit_context_free(c);
+    free(out);
+}
+
+static void test_skip(const char *data, int len) {
+    CHECK(amf3_skip_value(data, len) == len);
+    CHECK(amf3_skip_value(data, len - 1) == 0);
+    CHECK(amf3_validate_value(data, len) == 0);
+    CHECK(amf3_validate_value(data, len - 1) == -1);
+    static const char bad[] = {AMF3_ARRAY, 0x03, 0x01, 0x7f};
+    CHECK(amf3_skip_value(bad, sizeof(bad)) == -1);
+    CHECK(amf3_validate_value(bad, sizeof(bad)) == -1);
+}
+
+/* nesting past AMF3_MAX_DEPTH is malformed rather than a stack overflow. */
+static void test_depth() {
+    int n = 2000000, i;
+    char *deep = malloc(3 * n);
+    for (i = 0; i < n; i++)
+	memcpy(deep + 3 * i, "\x09\x03\x01", 3);
+    CHECK(amf3_skip_value(deep, 3 * n) == -1);
+    CHECK(amf3_validate_value(deep, 3 * n) == -1);
+    AMF3ParseContext c = amf3_parse_context_new(deep, 3 * n);
+    CHECK(amf3_parse_value(c) == NULL);
+    amf3_parse_context_free(c);
+    AMF3PushParser p = amf3_push_parser_new(0);
+    CHECK(amf3_push_parser_feed(p, deep, 3 * n, NULL) == AMF3_PUSH_ERROR);
+    amf3_push_parser_free(p);
+
+    // AMF3_MAX_DEPTH itself is fine
+    n = AMF3_MAX_DEPTH;
+    deep[3 * n] = AMF3_NULL;
+    CHECK(amf3_skip_value(deep, 3 * n + 1) == 3 * n + 1);
+    c = amf3_parse_context_new(deep, 3 * n + 1);
+    AMF3Value v = amf3_parse_value(c);
+    CHECK(v && c->left == 0);
+    if (v)
+	amf3_release(v);
+    amf3_parse_context_free(c);
+    free(deep);
+}
+
+/* counts matches, and adds up those that are integers */
+static int sum_match(AMF3Value v, void *ctx) {
+    int *sum = ctx;
+    sum[0]++;
+    if (v->type == AMF3_INTEGER)
+	sum[1] += v->v.integer;
+    return 0;
+}
+
+static void test_path(AMF3Value msg, const char *data, int len) {
+    int expected = 0, i;
+    for (i = 0; i < 40; i++)
+	expected += (i * 37 - 100) * (i % 10 == 0 ? 2 : 1);
+
+    AMF3Path path = amf3_path_compile("[*].id");
+    CHECK(path != NULL);
+    int sum[2] = {0, 0};
+    CHECK(amf3_path_eval(path, msg, sum_match, sum) == 44);
+    CHECK(sum[0] == 44 && sum[1] == expected);
+    sum[0] = sum[1] = 0;
+    CHECK(amf3_path_query(path, data, len, 0, sum_match, sum) == 44);
+    CHECK(sum[0] == 44 && sum[1] == expected);
+    amf3_path_free(path);
+
+    static const char *const hits[] = {"total", "[3].name", "[*].odd"};
+    static const int nhit[] = {1, 1, 20};
+    for (i = 0; i < 3; i++) {
+	path = amf3_path_compile(hits[i]);
+	CHECK(path && amf3_path_query(path, data, len, AMF3_PARSE_INTERN,
+		    sum_match, (int[2]){0, 0}) == nhit[i]);
+	if (path)
+	    amf3_path_free(path);
+    }
+
+    static const char *const misses[] = {"nope", "[*].nope", "[1000]",
+	"total.id", "[0][0]"};
+    for (i = 0; i < 5; i++) {
+	path = amf3_path_compile(misses[i]);
+	sum[0] = 0;
+	CHECK(path && amf3_path_eval(path, msg, sum_match, sum) == 0 &&
+		amf3_path_query(path, data, len, 0, sum_match, sum) == 0 &&
+		sum[0] == 0);
+	if (path)
+	    amf3_path_free(path);
+    }
+    CHECK(amf3_path_compile("[1") == NULL);
+    CHECK(amf3_path_compile("[-1]") == NULL);
+}
+
+struct sink_buffer {
+    char *data;
+    int length;
+};
+
+static int sink_append(void *ctx, const void *data, int len) {
+    struct sink_buffer *b = ctx;
+    // take at most 100 bytes at a time to exercise partial writes
+    if (len > 100)
+	len = 100;
+    b->data = realloc(b->data, b->length + len);
+    memcpy(b->data + b->length, data, len);
+    b->length += len;
+    return len;
+}
+
+static void test_outputs(AMF3Value v, const char *data, int len) {
+    CHECK(amf3_serialize_measure(v) == len);
+
+    char *fixed = malloc(len);
+    AMF3SerializeContext c = amf3_serialize_context_new_buffer(fixed, len);
+    CHECK(amf3_serialize_value(c, v) == len);
+    int n;
+    CHECK(amf3_serialize_context_get_buffer(c, &n) == fixed && n == len &&
+	    memcmp(fixed, data, len) == 0);
+    amf3_serialize_context_free(c);
+    c = amf3_serialize_context_new_buffer(fixed, len - 1);
+    amf3_serialize_value(c, v);
+    CHECK(amf3_serialize_context_get_buffer(c, &n) == NULL);
+    amf3_serialize_context_free(c);
+    free(fixed);
+
+    c = amf3_serialize_context_new_ex(AMF3_SERIALIZE_IOVEC);
+    CHECK(amf3_serialize_value(c, v) == len);
+    int niov, i, off = 0, same = 1;
+    const struct iovec *iov = amf3_serialize_context_get_iovec(c, &niov);
+    CHECK(iov && niov > 1);
+    for (i = 0; iov && i < niov; i++) {
+	same = same && off + (int)iov[i].iov_len <= len &&
+	    memcmp(data + off, iov[i].iov_base, iov[i].iov_len) == 0;
+	off += iov[i].iov_len;
+    }
+    CHECK(same && off == len);
+    amf3_serialize_context_free(c);
+
+    struct sink_buffer sb = {NULL, 0};
+    c = amf3_serialize_context_new_sink(sink_append, &sb, 256);
+    CHECK(amf3_serialize_value(c, v) == len);
+    CHECK(amf3_serialize_context_flush(c) == 0);
+    CHECK(sb.length == len && memcmp(sb.data, data, len) == 0);
+    amf3_serialize_context_free(c);
+    free(sb.data);
+}
+
+/* contexts start over keeping what they allocated, and pooled ones are
+ * handed out again. */
+static void test_reset(const char *data, int len) {
+    AMF3ParseContext c = amf3_parse_context_new_ex(data, len,
+	    AMF3_PARSE_ARENA);
+    CHECK(amf3_parse_value(c) != NULL);
+    int nalloc = c->object_refs->nalloc;
+    amf3_parse_context_reset(c, data, len);
+    CHECK(c->object_refs->nref == 0 && c->object_refs->nalloc == nalloc);
+    CHECK(c->arena->head == NULL && c->arena->spare != NULL);
+    AMF3Value v = amf3_parse_value(c);
+    CHECK(v && c->left == 0 && encodes_to(v, data, len));
+    amf3_parse_context_free(c);
+
+    AMF3SerializeContext s = amf3_serialize_context_new();
+    v = build_message();
+    amf3_serialize_value(s, v);
+    char *buffer = s->buffer;
+    int allocated = s->allocated;
+    amf3_serialize_context_reset(s);
+    CHECK(s->length == 0 && s->object_refs->nref == 0);
+    amf3_serialize_value(s, v);
+    int n;
+    const char *out = amf3_serialize_context_get_buffer(s, &n);
+    CHECK(s->buffer == buffer && s->allocated == allocated);
+    CHECK(out && n == len && memcmp(out, data, len) == 0);
+    amf3_serialize_context_free(s);
+    amf3_release(v);
+
+    c = amf3_parse_context_acquire(data, len, AMF3_PARSE_ARENA);
+    amf3_parse_context_release(c);
+    AMF3ParseContext c2 = amf3_parse_context_acquire(data, len,
+	    AMF3_PARSE_ARENA);
+    CHECK(c2 == c);
+    v = amf3_parse_value(c2);
+    CHECK(v && encodes_to(v, data, len));
+    amf3_parse_context_release(c2);
+    s = amf3_serialize_context_acquire();
+    amf3_serialize_context_release(s);
+    CHECK(amf3_serialize_context_acquire() == s);
+    amf3_serialize_context_release(s);
+    amf3_context_pool_clear();
+
+    // a sink's buffer empties on a flush, but does not grow
+    struct sink_buffer sb = {NULL, 0};
+    s = amf3_serialize_context_new_sink(sink_append, &sb, 256);
+    CHECK(amf3_serialize_context_reserve(s, 256) == 0);
+    CHECK(amf3_serialize_context_reserve(s, 257) == -1);
+    amf3_serialize_context_free(s);
+    free(sb.data);
+}
+
+struct lookups {
+    int stop;
+    int misses;
+};
+
+static void *lookup_main(void *L) {
+    struct lookups *l = L;
+    static const char flex[] = "flex.messaging.io.ArrayCollection";
+    while (!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+	if (!amf3_plugin_find(flex, sizeof(flex) - 1))
+	    __atomic_fetch_add(&l->misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* classes registered while other threads look plugins up. */
+static void test_plugins(const char *data, int len) {
+    static const char flex[] = "flex.messaging.io.ArrayCollection";
+    const struct amf3_plugin_parser *ac = amf3_plugin_find(flex,
+	    sizeof(flex) - 1);
+    CHECK(ac != NULL);
+    if (!ac)
+	return;
+    struct amf3_plugin_parser pp = *ac;
+
+    struct lookups l = {0, 0};
+    pthread_t threads[4];
+    int i, registered = 0;
+    for (i = 0; i < 4; i++)
+	pthread_create(&threads[i], NULL, lookup_main, &l);
+    char name[32];
+    for (i = 0; i < 200; i++) {
+	snprintf(name, sizeof(name), "test.Class%d", i);
+	pp.classname = name;
+	if (amf3_plugin_register(&pp) == 0)
+	    registered++;
+    }
+    __atomic_store_n(&l.stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < 4; i++)
+	pthread_join(threads[i], NULL);
+    CHECK(registered == 200 && l.misses == 0);
+    for (i = 0; i < 200; i++) {
+	snprintf(name, sizeof(name), "test.Class%d", i);
+	const struct amf3_plugin_parser *found = amf3_plugin_find(name,
+		strlen(name));
+	CHECK(found && strcmp(found->classname, name) == 0);
+    }
+    CHECK(amf3_plugin_register(&pp) == -1);
+    CHECK(amf3_plugin_find("test.Class", 10) == NULL);
+
+    // a plugin without a visitfunc runs again on each feed, and what it
+    // returns for a body cut short is freed
+    AMF3Value v = build_collection(data, len);
+    int n;
+    char *out = serialize(v, &n);
+    amf3_release(v);
+    char blind[sizeof(flex)];
+    memset(blind, '_', sizeof(flex) - 1);
+    memcpy(blind, "test.Blind", 10);
+    blind[sizeof(flex) - 1] = '\0';
+    pp.classname = blind;
+    pp.visitfunc = NULL;
+    CHECK(amf3_plugin_register(&pp) == 0);
+    for (i = 0; i + (int)sizeof(flex) - 1 <= n; i++)
+	if (memcmp(out + i, flex, sizeof(flex) - 1) == 0) {
+	    memcpy(out + i, blind, sizeof(flex) - 1);
+	    break;
+	}
+    CHECK(i + (int)sizeof(flex) - 1 <= n);
+    check_push(out, n, 0, 4096);
+    size_t used = check_push(out, n, AMF3_PARSE_ARENA, n);
+    CHECK(check_push(out, n, AMF3_PARSE_ARENA, 4096) == used);
+    free(out);
+}
+
+struct shared_value {
+    AMF3Value v;
+    const char *data;
+    int length;
+    int same;
+};
+
+static void *serialize_main(void *S) {
+    struct shared_value *s = S;
+    int i;
+    for (i = 0; i < 50; i++) {
+	AMF3Value v = amf3_retain(s->v);
+	if (!encodes_to(v, s->data, s->length))
+	    s->same = 0;
+	amf3_release(v);
+    }
+    return NULL;
+}
+
+/* a frozen tree serializes the same from several threads at once. */
+static void test_freeze(const char *data, int len) {
+    AMF3ParseContext c = amf3_parse_context_new(data, len);
+    AMF3Value v = amf3_parse_value(c);
+    amf3_parse_context_free(c);
+    CHECK(v && amf3_freeze(v) == 0 && (v->flags & AMF3_VALUE_FROZEN));
+    if (!v)
+	return;
+    struct shared_value shared[4];
+    pthread_t threads[4];
+    int i;
+    for (i = 0; i < 4; i++) {
+	shared[i].v = v;
+	shared[i].data = data;
+	shared[i].length = len;
+	shared[i].same = 1;
+	pthread_create(&threads[i], NULL, serialize_main, &shared[i]);
+    }
+    for (i = 0; i < 4; i++) {
+	pthread_join(threads[i], NULL);
+	CHECK(shared[i].same);
+    }
+    CHECK(v->retain_count == 1);
+    amf3_release(v);
+}
+
+static void test_parse_batch(const char *data, int len) {
+    // the value of an associative entry is missing
+    static const char assoc[] = {AMF3_ARRAY, 0x01, 0x03, 'a'};
+    static const char bad[] = {0x7f};
+    AMF3ParseContext c = amf3_parse_context_new(assoc, sizeof(assoc));
+    CHECK(amf3_parse_value(c) == NULL);
+    amf3_parse_context_free(c);
+
+    enum { N = 64 };
+    struct amf3_parse_item items[N];
+    char *ints[N];
+    int i;
+    for (i = 0; i < N; i++) {
+	ints[i] = NULL;
+	items[i].data = data;
+	items[i].length = len;
+	if (i % 4) {
+	    AMF3Value v = amf3_new_integer(i * 1000);
+	    items[i].data = ints[i] = serialize(v, &items[i].length);
+	    amf3_release(v);
+	}
+    }
+    items[8].length = len - 1;
+    items[13].data = bad;
+    items[13].length = sizeof(bad);
+    items[21].data = assoc;
+    items[21].length = sizeof(assoc);
+
+    AMF3WorkerPool pool = amf3_worker_pool_new(3);
+    CHECK(pool != NULL);
+    if (!pool)
+	return;
+    CHECK(amf3_parse_batch(pool, items, N, AMF3_PARSE_ARENA, NULL, NULL)
+	    == -1);
+    CHECK(amf3_parse_batch(pool, items, N, AMF3_PARSE_INTERN, NULL, NULL)
+	    == 0);
+    for (i = 0; i < N; i++) {
+	struct amf3_parse_item *item = &items[i];
+	if (i == 8 || i == 21)
+	    CHECK(!item->value && item->error == AMF3_ITEM_TRUNCATED);
+	else if (i == 13)
+	    CHECK(!item->value && item->error == AMF3_ITEM_MALFORMED);
+	else
+	    CHECK(item->value && item->error == AMF3_ITEM_OK &&
+		    encodes_to(item->value, item->data, item->length));
+	if (item->value)
+	    amf3_release(item->value);
+	free(ints[i]);
+    }
+    amf3_worker_pool_free(pool);
+}
+
+static void test_serialize_batch(const char *data, int len) {
+    AMF3ParseContext c = amf3_parse_context_new(data, len);
+    AMF3Value msg = amf3_parse_value(c);
+    amf3_parse_context_free(c);
+    // several items hold the message
+    CHECK(msg && amf3_freeze(msg) == 0);
+    AMF3WorkerPool pool = amf3_worker_pool_new(3);
+    CHECK(pool != NULL);
+    if (!msg || !pool)
+	return;
+
+    enum { N = 48, BAD = 10 };
+    AMF3Value values[N];
+    struct amf3_serialize_item items[N];
+    int i;
+    for (i = 0; i < N; i++) {
+	if (i % 3 == 0)
+	    values[i] = amf3_retain(msg);
+	else {
+	    char buf[16];
+	    snprintf(buf, sizeof(buf), "item %d", i);
+	    values[i] = i % 3 == 1 ? amf3_new_string_utf8(buf)
+		: amf3_new_integer(i * 1000);
+	}
+	items[i].value = values[i];
+    }
+    // traits are not values of their own
+    items[BAD].value = amf3_object_traits_get(amf3_array_get(msg, 0));
+    CHECK(amf3_serialize_batch(pool, items, N, NULL, NULL) == 0);
+    for (i = 0; i < N; i++) {
+	if (i == BAD) {
+	    CHECK(!items[i].data && items[i].error == AMF3_ITEM_FAILED);
+	    continue;
+	}
+	CHECK(items[i].data && items[i].error == AMF3_ITEM_OK &&
+		encodes_to(values[i], items[i].data, items[i].length));
+	free(items[i].data);
+    }
+
+    int *offsets, length;
+    char *all = amf3_serialize_batch_concat(pool, values, N, &offsets,
+	    &length);
+    CHECK(all && offsets[0] == 0 && offsets[N] == length);
+    for (i = 0; all && i < N; i++)
+	CHECK(offsets[i] < offsets[i + 1] && encodes_to(values[i],
+		    all + offsets[i], offsets[i + 1] - offsets[i]));
+    free(all);
+    free(offsets);
+
+    AMF3Value good = values[BAD];
+    values[BAD] = items[BAD].value;
+    CHECK(amf3_serialize_batch_concat(pool, values, N, &offsets, &length)
+	    == NULL);
+    values[BAD] = good;
+    for (i = 0; i < N; i++)
+	amf3_release(values[i]);
+    amf3_release(msg);
+    amf3_worker_pool_free(pool);
+}
+
+int main() {
+    AMF3Value msg = build_message();
+    int len;
+    char *data = serialize(msg, &len);
+
+    test_arena();
+    test_parse_flags(data, len);
+    test_detach(data, len);
+    test_traits();
+    test_singletons();
+    test_accessor();
+    test_intern(data, len);
+    test_push(data, len);
+    test_push_external(data, len);
+    test_visit();
+    test_skip(data, len);
+    test_depth();
+    test_path(msg, data, len);
+    test_outputs(msg, data, len);
+    test_reset(data, len);
+    test_plugins(data, len);
+    test_freeze(data, len);
+    test_parse_batch(data, len);
+    test_serialize_batch(data, len);
+
+    free(data);
+    amf3_release(msg);
+    if (failures)
+	fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}